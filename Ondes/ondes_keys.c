@@ -0,0 +1,77 @@
+/*
+  ondes_keys.c
+
+  Key state and note priority. See ondes_keys.h
+*/
+
+#include <stdint.h>
+#include <strings.h>
+#include "ondes_keys.h"
+
+uint8_t     keyPriority = KEYS_LOW;
+const char *keyPriorityNames[KEYS_MODES] = { "Low", "High", "Last", "First" };
+
+void keysClear(keyState *ks) {
+  ks->bits[0] = ks->bits[1] = 0;
+  ks->first = ks->last = KEYS_NONE;
+}
+
+uint8_t keysHeld(const keyState *ks, uint8_t key) {
+  return (key < 128) && ((ks->bits[key >> 6] >> (key & 63)) & 1);
+}
+
+void keysPress(keyState *ks, uint8_t key) {
+  /* Add the key to the end of the order. A key already held keeps its
+     place */
+  if ((key >= 128) || keysHeld(ks, key)) return;
+  ks->bits[key >> 6] |= (uint64_t) 1 << (key & 63);
+  ks->prev[key] = ks->last;
+  ks->next[key] = KEYS_NONE;
+  if (KEYS_NONE == ks->last) {
+    ks->first = key;
+  } else {
+    ks->next[ks->last] = key;
+  }
+  ks->last = key;
+}
+
+void keysRelease(keyState *ks, uint8_t key) {
+  if (!keysHeld(ks, key)) return;
+  ks->bits[key >> 6] &= ~((uint64_t) 1 << (key & 63));
+  if (KEYS_NONE == ks->prev[key]) {
+    ks->first = ks->next[key];
+  } else {
+    ks->next[ks->prev[key]] = ks->next[key];
+  }
+  if (KEYS_NONE == ks->next[key]) {
+    ks->last = ks->prev[key];
+  } else {
+    ks->prev[ks->next[key]] = ks->prev[key];
+  }
+}
+
+uint8_t keysNote(const keyState *ks) {
+  /* The key to play under the current priority, or KEYS_NONE */
+  switch (keyPriority) {
+  case KEYS_HIGH:
+    if (ks->bits[1]) return 127 - __builtin_clzll(ks->bits[1]);
+    if (ks->bits[0]) return 63 - __builtin_clzll(ks->bits[0]);
+    return KEYS_NONE;
+  case KEYS_LAST:
+    return ks->last;
+  case KEYS_FIRST:
+    return ks->first;
+  default:
+    if (ks->bits[0]) return __builtin_ctzll(ks->bits[0]);
+    if (ks->bits[1]) return 64 + __builtin_ctzll(ks->bits[1]);
+    return KEYS_NONE;
+  }
+}
+
+int keysPriorityByName(const char *name) {
+  /* Any case. Returns -1 if the name isn't known */
+  for (uint8_t i = 0; i < KEYS_MODES; i++) {
+    if (0 == strcasecmp(name, keyPriorityNames[i])) return i;
+  }
+  return -1;
+}
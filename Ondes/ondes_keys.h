@@ -0,0 +1,50 @@
+/*
+  ondes_keys.h
+
+  The keys held, and which one the Ondes plays. The Ondes Martenot is
+  monophonic and sounds the lowest key held, but other priorities suit
+  other playing:
+    KEYS_LOW    lowest key held
+    KEYS_HIGH   highest key held
+    KEYS_LAST   the key pressed most recently, going back to the one
+                before when it is released (trills with a held note)
+    KEYS_FIRST  the key held longest
+  The held keys are a 128-bit bitmap (MIDI note numbers, or the 49 keys
+  of the matrix keyboard), so the lowest and highest are found with one
+  count trailing / leading zeros instruction, and they are also linked
+  in the order they were pressed. Pressing, releasing and finding the
+  key to play all take the same time however many keys are held.
+*/
+
+#ifndef ONDES_KEYS_H
+#define ONDES_KEYS_H
+
+#include <stdint.h>
+
+#define KEYS_LOW    0
+#define KEYS_HIGH   1
+#define KEYS_LAST   2
+#define KEYS_FIRST  3
+#define KEYS_MODES  4
+
+#define KEYS_NONE   255  // no key held
+
+typedef struct {
+  uint64_t bits[2];    // key n is bit n % 64 of bits[n / 64]
+  uint8_t  prev[128];  // held keys in the order they were pressed
+  uint8_t  next[128];
+  uint8_t  first;      // KEYS_NONE if no keys are held
+  uint8_t  last;
+} keyState;
+
+extern uint8_t     keyPriority;
+extern const char *keyPriorityNames[KEYS_MODES];
+
+void    keysClear(keyState *);
+void    keysPress(keyState *, uint8_t);
+void    keysRelease(keyState *, uint8_t);
+uint8_t keysHeld(const keyState *, uint8_t);
+uint8_t keysNote(const keyState *);
+int     keysPriorityByName(const char *);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+  ondes_midibench.c
+
+  Measures how fast ondes_midifile.c compiles MIDI files, and checks that
+  it copes with damaged ones. Each file is read into memory once and then
+  parsed repeatedly for about half a second, so the figures are for the
+  parser alone rather than the SD card or USB stick.
+
+  Usage:
+    ondes_midibench [-check] file.mid ...
+  e.g. with every file in /usbdrive/MIDI as the corpus
+
+  With -check every file is also parsed cut short at every length, and
+  with random bytes overwritten, which must never crash or hang (build it
+  with -fsanitize=address to catch reads outside the data as well).
+
+  Compile:
+    cc -O2 -o ~/Ondes/ondes_midibench ondes_midibench.c ondes_midifile.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ondes_midifile.h"
+
+static double seconds(void) {
+  struct timespec tm;
+  clock_gettime(CLOCK_MONOTONIC, &tm);
+  return tm.tv_sec + tm.tv_nsec / 1.0e9;
+}
+
+static uint8_t *readFile(const char *path, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  uint8_t *data = NULL;
+  long len;
+  if (NULL == f) return NULL;
+  if ((0 == fseek(f, 0, SEEK_END)) && ((len = ftell(f)) > 0) &&
+      (0 == fseek(f, 0, SEEK_SET)) && (data = malloc(len))) {
+    if (fread(data, 1, len, f) != (size_t) len) {
+      free(data);
+      data = NULL;
+    }
+    *size = len;
+  }
+  fclose(f);
+  return data;
+}
+
+static void check(const uint8_t *data, size_t size) {
+  /* Parse every truncation of the file, then copies with random damage.
+     Only surviving matters here, so the parser's warnings are hidden */
+  midiSong song;
+  uint8_t *copy = malloc(size);
+  int err = dup(2), null = open("/dev/null", O_WRONLY);
+  fflush(stderr);
+  if (null >= 0) {
+    dup2(null, 2);
+    close(null);
+  }
+  for (size_t len = 0; len < size; len++) {
+    copy = realloc(copy, len ? len : 1);
+    memcpy(copy, data, len);
+    if (0 == midiParse(copy, len, &song)) midiFree(&song);
+  }
+  copy = realloc(copy, size);
+  for (uint32_t i = 0; i < 1000; i++) {
+    memcpy(copy, data, size);
+    for (uint8_t j = 0; j < 8; j++) copy[rand() % size] = rand();
+    if (0 == midiParse(copy, size, &song)) midiFree(&song);
+  }
+  fflush(stderr);
+  if (err >= 0) {
+    dup2(err, 2);
+    close(err);
+  }
+  free(copy);
+}
+
+int main(int argc, char *argv[]) {
+  uint8_t doCheck = 0;
+  uint32_t files = 0, failed = 0;
+  double totalBytes = 0, totalEvents = 0, totalSecs = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [-check] file.mid ...\n", argv[0]);
+    return 1;
+  }
+  for (int i = 1; i < argc; i++) {
+    size_t size = 0;
+    uint8_t *data;
+    midiSong song;
+    if (0 == strcmp(argv[i], "-check")) {
+      doCheck = 1;
+      continue;
+    }
+    if (NULL == (data = readFile(argv[i], &size))) {
+      fprintf(stderr, "%s: can't read\n", argv[i]);
+      failed++;
+      continue;
+    }
+    files++;
+    if (midiParse(data, size, &song)) {
+      printf("%-30s  FAILED\n", argv[i]);
+      failed++;
+    } else {
+      uint32_t count = song.count, micros = song.micros, loops = 0;
+      uint16_t tracks = song.tracks;
+      midiFree(&song);
+      double start = seconds(), secs;
+      do {
+	midiParse(data, size, &song);
+	midiFree(&song);
+	loops++;
+      } while ((secs = seconds() - start) < 0.5);
+      printf("%-30s  %2u tracks %7u events %5.0fs  %8.1f MB/s %8.2f Mevents/s\n",
+	     argv[i], tracks, count, micros / 1.0e6,
+	     size * loops / secs / 1.0e6, (double) count * loops / secs / 1.0e6);
+      totalBytes  += (double) size * loops;
+      totalEvents += (double) count * loops;
+      totalSecs   += secs;
+    }
+    if (doCheck) check(data, size);
+    free(data);
+  }
+  if (totalSecs > 0) {
+    printf("%u files (%u failed): %.1f MB/s, %.2f Mevents/s%s\n", files, failed,
+	   totalBytes / totalSecs / 1.0e6, totalEvents / totalSecs / 1.0e6,
+	   (doCheck) ? ", damaged copies all survived" : "");
+  }
+
+  return (failed) ? 1 : 0;
+}
@@ -0,0 +1,509 @@
+/*
+  ondes_midifile.c
+
+  Standard MIDI File loading for ondes_server (either variant).
+  See ondes_midifile.h
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ondes_midifile.h"
+
+#define MIDI_DEFAULT_TEMPO 500000 // microseconds per crotchet (120 bpm)
+
+/* Time signature changes, kept while compiling to find the bars */
+typedef struct {
+  uint32_t tick;
+  uint32_t ticksPerBar;
+} midiTimeSig;
+
+/* A read position within one track of the file. Every read is checked
+   against the end of the track, so a truncated or corrupt file can only
+   end the track early. The data is read where it is in the mapped file,
+   never copied */
+typedef struct {
+  const uint8_t *ptr;
+  const uint8_t *end;
+  uint8_t running;   // running status (0 = none)
+} smfCursor;
+
+/* One track of the file being merged. The tracks waiting to be merged
+   are kept in a binary min-heap ordered by the tick of their next event
+   (and then by track number, so that a tempo change in track 0 comes
+   before notes at the same tick), so each event costs O(log tracks) */
+typedef struct {
+  smfCursor cur;
+  uint32_t  tick;
+  uint16_t  track;
+} midiTrack;
+
+static uint32_t tickMicros(const midiTempo *tempo, uint16_t ticksPerQtr,
+			   uint32_t tick) {
+  return tempo->micros +
+    (uint32_t) (((uint64_t) (tick - tempo->tick) * tempo->qtrMicros +
+		 ticksPerQtr / 2) / ticksPerQtr);
+}
+
+static uint32_t be32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int smfByte(smfCursor *c, uint8_t *b) {
+  if (c->ptr >= c->end) return -1;
+  *b = *c->ptr++;
+  return 0;
+}
+
+static int smfVarLen(smfCursor *c, uint32_t *val) {
+  /* Variable length values are at most 4 bytes (28 bits) */
+  uint8_t b;
+  *val = 0;
+  for (uint8_t i = 0; i < 4; i++) {
+    if (smfByte(c, &b)) return -1;
+    *val = (*val << 7) | (b & 0x7f);
+    if (!(b & 0x80)) return 0;
+  }
+  return -1;
+}
+
+static int smfSkip(smfCursor *c, uint32_t len) {
+  if (len > (uint32_t) (c->end - c->ptr)) return -1;
+  c->ptr += len;
+  return 0;
+}
+
+static int grow(void *arrayPtr, uint32_t *space, uint32_t count, size_t size) {
+  /* Make room for one more entry at the end of a malloc()ed array,
+     doubling its size when it is full */
+  void **array = arrayPtr;
+  if (count == *space) {
+    void *bigger;
+    uint32_t newSpace = (*space) ? *space * 2 : 64;
+    if (NULL == (bigger = realloc(*array, newSpace * size))) return -1;
+    *array = bigger;
+    *space = newSpace;
+  }
+  return 0;
+}
+
+void midiCtrlReset(midiCtrlState *ctrl) {
+  memset(ctrl, 0, sizeof(midiCtrlState));
+}
+
+uint8_t midiCtrl14(midiCtrlState *ctrl, const midiEvent *ev, uint16_t *num,
+		   uint16_t *val) {
+  /* Follow a Control Change. Returns 1 with the controller and its 14-bit
+     value if one has changed, or 0 if the event only chose a parameter
+     or was Data Entry for an RPN */
+  uint8_t chan = ev->status & 0x0f, cc = ev->data1, v = ev->data2;
+  switch (cc) {
+  case 99: // NRPN MSB, LSB
+  case 98:
+  case 101: // RPN MSB, LSB
+  case 100:
+    ctrl->param[chan][cc & 1] = v;
+    ctrl->select[chan] = (cc >= 100) ? 2 : 1;
+    if ((cc >= 100) && (127 == ctrl->param[chan][0]) &&
+	(127 == ctrl->param[chan][1])) ctrl->select[chan] = 0; // RPN Null
+    return 0;
+  case 6: // Data Entry MSB
+  case 38: // and LSB
+    if (!ctrl->select[chan]) break;
+    if (2 == ctrl->select[chan]) return 0;
+    if (6 == cc) ctrl->data[chan] = v;
+    *num = MIDI_NRPN | (ctrl->param[chan][1] << 7) | ctrl->param[chan][0];
+    *val = (6 == cc) ? v << 7 : (ctrl->data[chan] << 7) | v;
+    return 1;
+  }
+  if (cc < 32) {
+    /* A new MSB clears the LSB */
+    ctrl->msb[chan][cc] = v;
+    *num = cc;
+    *val = v << 7;
+  } else if (cc < 64) {
+    *num = cc - 32;
+    *val = (ctrl->msb[chan][cc - 32] << 7) | v;
+  } else {
+    *num = cc;
+    *val = v << 7;
+  }
+  return 1;
+}
+
+static void updateState(midiSnapshot *state, midiCtrlState *ctrl,
+			const midiEvent *ev) {
+  /* Follow the effect of an event on the controller state */
+  uint16_t num, val;
+  switch (ev->status & 0xf0) {
+  case 0xb0:
+    state->cc[ev->data1] = ev->data2;
+    if (midiCtrl14(ctrl, ev, &num, &val) &&
+	((num & ~7) == MIDI_NRPN_ANLG(0))) state->nrpn[num & 7] = val;
+    break;
+  case 0xc0:
+    state->program = ev->data1;
+    break;
+  case 0xe0:
+    state->bendLsb = ev->data1;
+    state->bendMsb = ev->data2;
+    break;
+  case 0x90:
+    if (ev->data2) {
+      state->note = ev->data1;
+      break;
+    }
+    /* Note On with velocity 0 is Note Off */
+    /* fall through */
+  case 0x80:
+    if (state->note == ev->data1) state->note = MIDI_UNSET;
+    break;
+  }
+}
+
+static int buildIndex(midiSong *song, const midiTempo *tempos, uint32_t nTempo,
+		      const midiTimeSig *sigs, uint32_t nSig) {
+  /* Find the bar lines from the time signatures (4/4 until the first),
+     starting a new bar early if the time signature changes part way
+     through one, and record the time, first event and controller state
+     at each of them. Then put each marker in its bar. Returns -1 out of
+     memory, or 1 if there are more than MIDI_MAX_BARS bars */
+  uint32_t lastTick = (song->count) ? song->events[song->count - 1].tick : 0;
+  uint32_t ticksPerBar = 4 * song->ticksPerQtr;
+  uint32_t tick = 0, ev = 0, t = 0, sig = 0, space = 0;
+  midiSnapshot state;
+  midiCtrlState ctrl;
+  memset(&state, MIDI_UNSET, sizeof(state));
+  midiCtrlReset(&ctrl);
+
+  while (tick <= lastTick) {
+    midiBar *bar;
+    while ((sig < nSig) && (sigs[sig].tick <= tick)) {
+      ticksPerBar = sigs[sig++].ticksPerBar;
+    }
+    while ((ev < song->count) && (song->events[ev].tick < tick)) {
+      updateState(&state, &ctrl, &song->events[ev++]);
+    }
+    while ((t + 1 < nTempo) && (tempos[t + 1].tick <= tick)) t++;
+    if (song->barCount == MIDI_MAX_BARS) {
+      fprintf(stderr, "MIDI file is longer than %u bars\n", MIDI_MAX_BARS);
+      return 1;
+    }
+    if (grow(&song->bars, &space, song->barCount, sizeof(midiBar))) return -1;
+    bar = &song->bars[song->barCount++];
+    bar->tick   = tick;
+    bar->micros = tickMicros(&tempos[t], song->ticksPerQtr, tick);
+    bar->event  = ev;
+    bar->marker = -1;
+    bar->state  = state;
+    uint32_t next = tick + ticksPerBar;
+    if ((sig < nSig) && (sigs[sig].tick < next)) next = sigs[sig].tick;
+    if (next <= tick) break; // can't happen, but never loop forever
+    tick = next;
+  }
+
+  for (uint16_t m = 0; m < song->markerCount; m++) {
+    uint32_t b = 0;
+    while ((b + 1 < song->barCount) &&
+	   (song->bars[b + 1].tick <= song->markers[m].tick)) b++;
+    song->markers[m].bar = b;
+    if (song->bars[b].marker < 0) song->bars[b].marker = m;
+  }
+
+  return 0;
+}
+
+uint32_t midiBarAt(const midiSong *song, uint32_t micros) {
+  /* Binary search for the index of the bar playing at a time */
+  uint32_t lo = 0, hi = song->barCount;
+  while (hi - lo > 1) {
+    uint32_t mid = (lo + hi) / 2;
+    if (song->bars[mid].micros <= micros) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static int trackBefore(const midiTrack *a, const midiTrack *b) {
+  return (a->tick < b->tick) || ((a->tick == b->tick) && (a->track < b->track));
+}
+
+static void heapDown(midiTrack *heap, uint16_t n, uint16_t i) {
+  /* Move heap[i] down until neither child comes before it */
+  midiTrack t = heap[i];
+  for (;;) {
+    uint16_t c = 2 * i + 1;
+    if (c >= n) break;
+    if ((c + 1 < n) && trackBefore(&heap[c + 1], &heap[c])) c++;
+    if (!trackBefore(&heap[c], &t)) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = t;
+}
+
+int midiParse(const uint8_t *data, size_t size, midiSong *song) {
+  /* Compile SMF data already in memory into song->events. Returns 0 on
+     success, or -1 with song left empty. A track which is truncated or
+     corrupt is ended at that point with a warning, keeping the events
+     read from it so far */
+  const uint8_t *tmp_p, *end_p = data + size;
+  midiTrack *heap = NULL;
+  uint16_t heapLen = 0;
+  uint32_t space = 0;
+  midiTempo tempo = { 0, 0, MIDI_DEFAULT_TEMPO };
+  midiTempo *tempos = NULL;
+  midiTimeSig *sigs = NULL;
+  uint32_t nTempo = 0, tempoSpace = 0, nSig = 0, sigSpace = 0;
+  uint32_t markerSpace = 0;
+  uint8_t smpte = 0;
+  int ret = -1;
+
+  memset(song, 0, sizeof(midiSong));
+
+  /* Find the MThd header, which may follow a RIFF wrapper */
+  tmp_p = memmem(data, (size < 200) ? size : 200, "MThd", 4);
+  if ((NULL == tmp_p) || (end_p - tmp_p < 14) || (be32(tmp_p + 4) < 6)) {
+    fprintf(stderr, "Failed to find MThd record\n");
+    return -1;
+  }
+  /* Unlike a track, a header can't be cut short - the pointer would wrap
+     on a 32 bit system */
+  if (be32(tmp_p + 4) > (uint32_t) (end_p - tmp_p - 8)) {
+    fprintf(stderr, "Bad MThd record\n");
+    return -1;
+  }
+  song->format = (tmp_p[8] << 8) | tmp_p[9];
+  song->tracks = (tmp_p[10] << 8) | tmp_p[11];
+  song->ticksPerQtr = (tmp_p[12] << 8) | tmp_p[13];
+  if (song->ticksPerQtr & 0x8000) {
+    /* SMPTE timing: -frames per second and ticks per frame. Ticks are a
+       fixed length and tempo changes are ignored. 29.97fps is given as
+       -29, and is treated as 30 frames per 1.001 seconds */
+    uint8_t fps = -(int8_t) tmp_p[12];
+    song->ticksPerQtr = ((29 == fps) ? 30 : fps) * tmp_p[13];
+    tempo.qtrMicros = (29 == fps) ? 1001000 : 1000000;
+    smpte = 1;
+  }
+  if ((0 == song->ticksPerQtr) || (0 == song->tracks)) {
+    fprintf(stderr, "Bad MThd record\n");
+    return -1;
+  }
+  /* The tempo changes are kept for the bar index, starting with the
+     default tempo from tick 0 */
+  if (grow(&tempos, &tempoSpace, nTempo, sizeof(midiTempo))) goto noMemory;
+  tempos[nTempo++] = tempo;
+
+  /* Step through the chunks after the header using their lengths,
+     collecting every MTrk (and ignoring any other chunk types), and read
+     the first delta time of each track. A chunk length running past the
+     end of the file is cut short */
+  if (NULL == (heap = malloc(song->tracks * sizeof(midiTrack)))) {
+    goto finished;
+  }
+  tmp_p += 8 + be32(tmp_p + 4);
+  while ((tmp_p < end_p) && (end_p - tmp_p >= 8) &&
+	 (heapLen < song->tracks)) {
+    uint32_t len = be32(tmp_p + 4);
+    if (len > (uint32_t) (end_p - tmp_p - 8)) len = end_p - tmp_p - 8;
+    if (0 == memcmp(tmp_p, "MTrk", 4)) {
+      midiTrack *t = &heap[heapLen];
+      t->cur.ptr = tmp_p + 8;
+      t->cur.end = t->cur.ptr + len;
+      t->cur.running = 0;
+      t->track = heapLen;
+      if (0 == smfVarLen(&t->cur, &t->tick)) heapLen++;
+    }
+    tmp_p += 8 + len;
+  }
+  if (0 == heapLen) {
+    fprintf(stderr, "Failed to find an MTrk record\n");
+    goto finished;
+  }
+  for (int i = heapLen / 2 - 1; i >= 0; i--) heapDown(heap, heapLen, i);
+
+  /* Merge the tracks in time order, keeping the channel messages and
+     following the tempo changes. The track with the earliest event is
+     always at the top of the heap */
+  while (heapLen) {
+    midiTrack *t = &heap[0];
+    smfCursor *c = &t->cur;
+    midiEvent ev = { 0 };
+    uint8_t b, ended = 0, bad = 0;
+    uint32_t len;
+    ev.tick  = t->tick;
+    ev.track = (t->track > 255) ? 255 : t->track;
+
+    if (smfByte(c, &b)) {
+      bad = 1;
+
+    } else if (0xff == b) {
+      /* META events - cancel running status */
+      uint8_t type;
+      c->running = 0;
+      if (smfByte(c, &type) || smfVarLen(c, &len) ||
+	  (len > (uint32_t) (c->end - c->ptr))) {
+	bad = 1;
+      } else if (0x2f == type) {
+	/* End of track */
+	ended = 1;
+      } else if ((0x51 == type) && (3 == len) && !smpte) {
+	/* Set tempo (microseconds per crotchet) from this tick on */
+	tempo.micros = tickMicros(&tempo, song->ticksPerQtr, ev.tick);
+	tempo.tick = ev.tick;
+	tempo.qtrMicros = (c->ptr[0] << 16) | (c->ptr[1] << 8) | c->ptr[2];
+	if (0 == tempo.qtrMicros) tempo.qtrMicros = MIDI_DEFAULT_TEMPO;
+	if (grow(&tempos, &tempoSpace, nTempo, sizeof(midiTempo))) goto noMemory;
+	tempos[nTempo++] = tempo;
+      } else if ((0x58 == type) && (len >= 2) && (c->ptr[1] <= 6)) {
+	/* Time signature - numerator and power of 2 denominator */
+	if (grow(&sigs, &sigSpace, nSig, sizeof(midiTimeSig))) goto noMemory;
+	sigs[nSig].tick = ev.tick;
+	sigs[nSig].ticksPerBar = (4 * song->ticksPerQtr * c->ptr[0]) >> c->ptr[1];
+	if (0 == sigs[nSig].ticksPerBar) sigs[nSig].ticksPerBar = 4 * song->ticksPerQtr;
+	nSig++;
+      } else if ((0x03 == type) && (0 == t->track) && !song->title[0]) {
+	/* Sequence / track name of the first track, taken as the title */
+	memcpy(song->title, c->ptr, (len < 32) ? len : 32);
+	song->title[(len < 32) ? len : 32] = 0;
+      } else if ((0x06 == type) && (song->markerCount < INT16_MAX)) {
+	/* Marker - kept as a rehearsal mark */
+	midiMarker *m;
+	if (grow(&song->markers, &markerSpace, song->markerCount,
+		 sizeof(midiMarker))) goto noMemory;
+	m = &song->markers[song->markerCount++];
+	m->tick = ev.tick;
+	m->bar = 0;
+	memcpy(m->name, c->ptr, (len < 16) ? len : 16);
+	m->name[(len < 16) ? len : 16] = 0;
+      }
+      if (!bad) c->ptr += len;
+
+    } else if ((0xf0 == b) || (0xf7 == b)) {
+      /* SysEx, or a SysEx continuation / escape - not used, so skip
+	 over it. Also cancels running status */
+      c->running = 0;
+      bad = smfVarLen(c, &len) || smfSkip(c, len);
+
+    } else if (b >= 0xf0) {
+      /* System Common / Real Time messages aren't allowed in a file */
+      bad = 1;
+
+    } else {
+      /* Channel messages - all have 2 data bytes except for Program
+	 Change and Channel Pressure. A data byte where the status byte
+	 should be means the status of the previous message is repeated */
+      if (b & 0x80) {
+	c->running = b;
+	bad = smfByte(c, &ev.data1);
+      } else if (c->running) {
+	ev.data1 = b;
+      } else {
+	bad = 1;
+      }
+      ev.status = c->running;
+      if (!bad && (0xc0 != (ev.status & 0xf0)) &&
+	  (0xd0 != (ev.status & 0xf0))) {
+	bad = smfByte(c, &ev.data2);
+      }
+      if (!bad) {
+	ev.data1 &= 0x7f;
+	ev.data2 &= 0x7f;
+	ev.micros = tickMicros(&tempo, song->ticksPerQtr, ev.tick);
+	if (grow(&song->events, &space, song->count, sizeof(midiEvent))) {
+	  goto noMemory;
+	}
+	song->events[song->count++] = ev;
+      }
+    }
+
+    /* Read the delta time to the next event, or take the track off the
+       heap if it has ended (a missing End of Track is tolerated) */
+    if (!ended && !bad && (c->ptr < c->end)) {
+      uint32_t delta;
+      if (smfVarLen(c, &delta) || (t->tick + delta < t->tick)) {
+	bad = 1;
+      } else {
+	t->tick += delta;
+      }
+    } else if (!ended && !bad) {
+      ended = 1;
+    }
+    if (bad) {
+      fprintf(stderr, "MIDI track %u is corrupt at tick %u - ignoring the rest\n",
+	      t->track, ev.tick);
+    }
+    if (ended || bad) heap[0] = heap[--heapLen];
+    heapDown(heap, heapLen, 0);
+  }
+
+  if (song->count) song->micros = song->events[song->count - 1].micros;
+  for (uint32_t i = 0; (i < nTempo) && (0 == tempos[i].tick); i++) {
+    song->qtrMicros = tempos[i].qtrMicros;
+  }
+  int built = buildIndex(song, tempos, nTempo, sigs, nSig);
+  if (built < 0) goto noMemory;
+  if (built) {
+    midiFree(song);
+    goto finished;
+  }
+  /* Keep the tempo map for MIDI clock */
+  song->tempos = tempos;
+  song->tempoCount = nTempo;
+  tempos = NULL;
+  ret = 0;
+  goto finished;
+
+ noMemory:
+  fprintf(stderr, "Out of memory loading MIDI file\n");
+  midiFree(song);
+
+ finished:
+  free(heap);
+  free(tempos);
+  free(sigs);
+  return ret;
+}
+
+int midiLoad(const char *path, midiSong *song) {
+  /* Map the file into memory and compile it with midiParse() */
+  struct stat sb;
+  int ret = -1;
+
+  memset(song, 0, sizeof(midiSong));
+  int midi_d = open(path, O_RDONLY);
+  if (midi_d < 0) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return -1;
+  }
+  if (fstat(midi_d, &sb) || (sb.st_size < 14)) {
+    fprintf(stderr, "%s is not a MIDI file\n", path);
+    close(midi_d);
+    return -1;
+  }
+  uint8_t *midi_p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, midi_d, 0);
+  if (MAP_FAILED != midi_p) {
+    ret = midiParse(midi_p, sb.st_size, song);
+    munmap(midi_p, sb.st_size);
+  }
+  close(midi_d);
+  return ret;
+}
+
+void midiFree(midiSong *song) {
+  free(song->events);
+  free(song->bars);
+  free(song->markers);
+  free(song->tempos);
+  memset(song, 0, sizeof(midiSong));
+}
@@ -0,0 +1,117 @@
+/*
+  ondes_midifile.h
+
+  Standard MIDI File loading for ondes_server (either variant). A file is
+  compiled when it is loaded into an array of the events to be played, each
+  with its time from the start of the piece in microseconds, so playback
+  is just a walk along the array. The parser checks every read against the
+  track it is in, so any file dropped onto the USB stick is safe to load.
+  ondes_midibench.c measures its speed over a set of files.
+
+  The song also gets an index of its bars, each with the controller state
+  at the bar line, so playback can start from any bar (or loop between
+  two) with the right registration, without reading from the start.
+*/
+
+#ifndef ONDES_MIDIFILE_H
+#define ONDES_MIDIFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A channel message from the file. Meta events (tempo, end of track etc.)
+   are used while compiling and not kept */
+typedef struct {
+  uint32_t micros; // time from the start of the piece
+  uint32_t tick;   // time from the start in MIDI ticks
+  uint8_t  status; // status byte, including the channel
+  uint8_t  data1;
+  uint8_t  data2;  // 0 for Program Change
+  uint8_t  track;  // track number (255 for any track after that)
+} midiEvent;
+
+/* 14-bit controllers. Controllers 0-31 take their LSB from controllers
+   32-63, and NRPNs are set through Data Entry (6 and 38) after choosing
+   the parameter with controllers 99 and 98. midiCtrl14() follows this
+   for each channel, whether the events come from a file or a keyboard,
+   and gives the controller (or MIDI_NRPN | the NRPN number) and its 14
+   bit value every time one changes. 7-bit controllers come out as the
+   value << 7. The Ondes controls have NRPNs of their own, MSB 0x4F with
+   the LSB the number of the analogue value (0 Touche, 1 Ruban, 2-5
+   levels, 6 Expression, 7 Feutre) */
+#define MIDI_NRPN       0x8000
+#define MIDI_NRPN_ONDES 0x4f
+#define MIDI_NRPN_ANLG(i) (MIDI_NRPN | (MIDI_NRPN_ONDES << 7) | (i))
+typedef struct {
+  uint8_t msb[16][32];    // last MSB of each of controllers 0-31
+  uint8_t param[16][2];   // NRPN or RPN chosen, LSB and MSB
+  uint8_t select[16];     // 0 none, 1 NRPN, 2 RPN
+  uint8_t data[16];       // Data Entry MSB
+} midiCtrlState;
+
+/* Controller state at a point in the song, as left by the events before
+   it. Anything not yet set by the file is MIDI_UNSET (MIDI_UNSET14 for
+   the Ondes NRPNs) */
+#define MIDI_UNSET   0xff
+#define MIDI_UNSET14 0xffff
+typedef struct {
+  uint8_t  cc[128];
+  uint8_t  program;
+  uint8_t  note;     // last note on which hasn't been turned off
+  uint8_t  bendLsb;
+  uint8_t  bendMsb;
+  uint16_t nrpn[8];  // the Ondes NRPNs
+} midiSnapshot;
+
+/* Longer files are refused (the LCD shows four digits of bar number),
+   which also stops a huge delta time asking for gigabytes of bars */
+#define MIDI_MAX_BARS 9999
+typedef struct {
+  uint32_t tick;
+  uint32_t micros;
+  uint32_t event;    // first event at or after the bar line
+  int16_t  marker;   // index of the first marker in the bar, or -1
+  midiSnapshot state;
+} midiBar;
+
+/* The tempo map is kept as the tick and time of the last tempo change, so
+   every event's time is worked out from there rather than by adding up
+   the rounded gaps between events, which drifts over a long piece */
+typedef struct {
+  uint32_t tick;
+  uint32_t micros;
+  uint32_t qtrMicros;
+} midiTempo;
+
+/* Marker (FF 06) meta events, used as rehearsal marks */
+typedef struct {
+  uint32_t tick;
+  uint32_t bar;      // index of the bar it is in
+  char     name[17];
+} midiMarker;
+
+typedef struct {
+  midiEvent *events;
+  uint32_t   count;
+  midiBar   *bars;     // bars[0] is bar 1
+  uint32_t   barCount;
+  midiMarker *markers;
+  uint16_t   markerCount;
+  midiTempo *tempos;   // tempos[0] is at tick 0
+  uint32_t   tempoCount;
+  uint16_t   format;
+  uint16_t   tracks;
+  uint16_t   ticksPerQtr;
+  uint32_t   micros;   // time of the last event
+  uint32_t   qtrMicros; // tempo at the start
+  char       title[33]; // name of the first track, if it has one
+} midiSong;
+
+int  midiParse(const uint8_t *, size_t, midiSong *);
+int  midiLoad(const char *, midiSong *);
+void midiFree(midiSong *);
+uint32_t midiBarAt(const midiSong *, uint32_t);
+void midiCtrlReset(midiCtrlState *);
+uint8_t midiCtrl14(midiCtrlState *, const midiEvent *, uint16_t *, uint16_t *);
+
+#endif
@@ -0,0 +1,449 @@
+/*
+  ondes_midiin.c
+
+  Streaming MIDI input. See ondes_midiin.h
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+#include "ondes_midifile.h"
+#include "ondes_midiin.h"
+
+#define ANY_PORTS 16   // most ports connected for "any"
+#define PENDING   256  // events merged at a time
+
+typedef struct {
+  char           name[64];
+  uint8_t        raw;       // raw device rather than sequencer port
+  uint8_t        connected;
+  midiInPort     port;      // raw device
+  snd_seq_addr_t addr;      // sequencer port
+} midiInput;
+
+uint32_t midiInEvents = 0;
+uint32_t midiInLost = 0;
+
+static midiInput inputs[MIDIIN_MAX];
+static uint8_t   inputCount = 0;
+static int8_t    anyInput = -1;    // the "any" input, if there is one
+static snd_seq_addr_t anyPorts[ANY_PORTS];
+static uint8_t   anyCount = 0;
+static uint32_t  retryMicros;
+
+static snd_seq_t *seq = NULL;
+static int        seqQueue, seqPort, seqClient;
+
+static midiEvent  pending[PENDING];
+static uint16_t   pendingCount = 0;
+
+static uint8_t dataBytes(uint8_t status) {
+  /* Program Change and Channel Pressure have one data byte, the other
+     channel messages two */
+  uint8_t type = status & 0xf0;
+  return ((0xc0 == type) || (0xd0 == type)) ? 1 : 2;
+}
+
+static void flush(midiInHandler handler) {
+  /* Pass on the events collected, in time order. Each input's events are
+     already in order, so an insertion sort has little to do */
+  for (uint16_t i = 1; i < pendingCount; i++) {
+    midiEvent ev = pending[i];
+    uint16_t j = i;
+    for (; (j > 0) && ((int32_t) (pending[j - 1].micros - ev.micros) > 0); j--) {
+      pending[j] = pending[j - 1];
+    }
+    pending[j] = ev;
+  }
+  for (uint16_t i = 0; i < pendingCount; i++) handler(&pending[i]);
+  midiInEvents += pendingCount;
+  pendingCount = 0;
+}
+
+static void addEvent(const midiEvent *ev, midiInHandler handler) {
+  if (PENDING == pendingCount) flush(handler);
+  pending[pendingCount++] = *ev;
+}
+
+static void release(uint8_t input, uint32_t micros, midiInHandler handler) {
+  /* An input has gone, so let go of anything it was holding */
+  midiEvent ev = { micros, 0, 0xb0, 123, 0, input };
+  fprintf(stderr, "MIDI input %s has gone\n", inputs[input].name);
+  if (handler) addEvent(&ev, handler);
+}
+
+static uint8_t sameAddr(const snd_seq_addr_t *a, const snd_seq_addr_t *b) {
+  return (a->client == b->client) && (a->port == b->port);
+}
+
+static int seqSubscribe(const snd_seq_addr_t *sender) {
+  /* Connect a port to ours through the queue, with every event stamped
+     with the real time it arrived */
+  snd_seq_port_subscribe_t *sub;
+  snd_seq_addr_t dest = { seqClient, seqPort };
+  snd_seq_port_subscribe_alloca(&sub);
+  snd_seq_port_subscribe_set_sender(sub, sender);
+  snd_seq_port_subscribe_set_dest(sub, &dest);
+  snd_seq_port_subscribe_set_queue(sub, seqQueue);
+  snd_seq_port_subscribe_set_time_update(sub, 1);
+  snd_seq_port_subscribe_set_time_real(sub, 1);
+  int err = snd_seq_subscribe_port(seq, sub);
+  return ((err < 0) && (-EBUSY != err)) ? -1 : 0;
+}
+
+static void seqConnect(uint8_t i) {
+  /* Connect a named port if it is there */
+  snd_seq_addr_t addr;
+  if ((snd_seq_parse_address(seq, &addr, inputs[i].name) < 0) ||
+      (addr.client == seqClient) || seqSubscribe(&addr)) return;
+  inputs[i].addr = addr;
+  inputs[i].connected = 1;
+  fprintf(stderr, "MIDI input %s connected\n", inputs[i].name);
+}
+
+static void seqConnectAny(const snd_seq_port_info_t *info) {
+  /* Connect a port for "any" if it is a hardware MIDI input which isn't
+     ours, isn't connected already and isn't named as an input itself */
+  snd_seq_addr_t addr = { snd_seq_port_info_get_client(info),
+			  snd_seq_port_info_get_port(info) };
+  unsigned int caps = SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ;
+  if ((anyInput < 0) || (anyCount == ANY_PORTS) ||
+      (addr.client == seqClient) ||
+      ((snd_seq_port_info_get_capability(info) & caps) != caps) ||
+      !(snd_seq_port_info_get_type(info) & SND_SEQ_PORT_TYPE_HARDWARE)) return;
+  for (uint8_t i = 0; i < anyCount; i++) {
+    if (sameAddr(&anyPorts[i], &addr)) return;
+  }
+  for (uint8_t i = 0; i < inputCount; i++) {
+    if (inputs[i].connected && !inputs[i].raw &&
+	sameAddr(&inputs[i].addr, &addr)) return;
+  }
+  if (seqSubscribe(&addr)) return;
+  anyPorts[anyCount++] = addr;
+  fprintf(stderr, "MIDI input %s connected\n",
+	  snd_seq_port_info_get_name(info));
+}
+
+static void seqGone(const snd_seq_addr_t *addr, uint32_t micros,
+		    midiInHandler handler) {
+  /* A port has gone, or been disconnected from ours */
+  for (uint8_t i = 0; i < inputCount; i++) {
+    if (inputs[i].connected && !inputs[i].raw &&
+	sameAddr(&inputs[i].addr, addr)) {
+      inputs[i].connected = 0;
+      release(i, micros, handler);
+    }
+  }
+  for (uint8_t i = 0; i < anyCount; i++) {
+    if (sameAddr(&anyPorts[i], addr)) {
+      anyPorts[i] = anyPorts[--anyCount];
+      release(anyInput, micros, handler);
+      break;
+    }
+  }
+}
+
+static void seqAnnounce(const snd_seq_event_t *sev, uint32_t micros,
+			midiInHandler handler) {
+  /* Ports starting and stopping, from System:Announce, and our own
+     subscriptions being removed */
+  if (SND_SEQ_EVENT_PORT_START == sev->type) {
+    snd_seq_port_info_t *info;
+    snd_seq_port_info_alloca(&info);
+    for (uint8_t i = 0; i < inputCount; i++) {
+      if (!inputs[i].raw && !inputs[i].connected &&
+	  (i != anyInput)) seqConnect(i);
+    }
+    if (0 == snd_seq_get_any_port_info(seq, sev->data.addr.client,
+				       sev->data.addr.port, info)) {
+      seqConnectAny(info);
+    }
+  } else if (SND_SEQ_EVENT_PORT_EXIT == sev->type) {
+    seqGone(&sev->data.addr, micros, handler);
+  } else if ((SND_SEQ_EVENT_PORT_UNSUBSCRIBED == sev->type) &&
+	     (sev->data.connect.dest.client == seqClient) &&
+	     (sev->data.connect.dest.port == seqPort)) {
+    seqGone(&sev->data.connect.sender, micros, handler);
+  }
+}
+
+static uint8_t seqEvent(const snd_seq_event_t *sev, midiEvent *ev) {
+  /* The channel message for a sequencer event. Returns 0 for anything
+     else (announcements, SysEx etc.) */
+  uint8_t chan = sev->data.control.channel & 0x0f;
+  int bend;
+  switch (sev->type) {
+  case SND_SEQ_EVENT_NOTEON:
+  case SND_SEQ_EVENT_NOTEOFF:
+  case SND_SEQ_EVENT_KEYPRESS:
+    ev->status = ((SND_SEQ_EVENT_NOTEON == sev->type) ? 0x90 :
+		  (SND_SEQ_EVENT_NOTEOFF == sev->type) ? 0x80 : 0xa0) |
+      (sev->data.note.channel & 0x0f);
+    ev->data1 = sev->data.note.note & 0x7f;
+    ev->data2 = sev->data.note.velocity & 0x7f;
+    break;
+  case SND_SEQ_EVENT_CONTROLLER:
+    ev->status = 0xb0 | chan;
+    ev->data1 = sev->data.control.param & 0x7f;
+    ev->data2 = sev->data.control.value & 0x7f;
+    break;
+  case SND_SEQ_EVENT_PGMCHANGE:
+  case SND_SEQ_EVENT_CHANPRESS:
+    ev->status = ((SND_SEQ_EVENT_PGMCHANGE == sev->type) ? 0xc0 : 0xd0) | chan;
+    ev->data1 = sev->data.control.value & 0x7f;
+    ev->data2 = 0;
+    break;
+  case SND_SEQ_EVENT_PITCHBEND:
+    bend = sev->data.control.value + 8192;
+    if (bend < 0) bend = 0;
+    if (bend > 16383) bend = 16383;
+    ev->status = 0xe0 | chan;
+    ev->data1 = bend & 0x7f;
+    ev->data2 = bend >> 7;
+    break;
+  default:
+    return 0;
+  }
+  return 1;
+}
+
+static uint8_t seqInput(const snd_seq_addr_t *source) {
+  /* Which input an event came from */
+  for (uint8_t i = 0; i < inputCount; i++) {
+    if (inputs[i].connected && !inputs[i].raw &&
+	sameAddr(&inputs[i].addr, source)) return i;
+  }
+  return (anyInput >= 0) ? anyInput : 0;
+}
+
+static int seqOpen(void) {
+  /* One client for all the sequencer inputs, with a port for them to
+     send to, a queue running in real time to stamp their events, and a
+     connection from System:Announce to hear about ports coming and
+     going */
+  if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0) {
+    fprintf(stderr, "Error: cannot open the ALSA sequencer\n");
+    seq = NULL;
+    return -1;
+  }
+  snd_seq_set_client_name(seq, "Ondes");
+  seqClient = snd_seq_client_id(seq);
+  seqPort = snd_seq_create_simple_port(seq, "Keyboard",
+				       SND_SEQ_PORT_CAP_WRITE |
+				       SND_SEQ_PORT_CAP_SUBS_WRITE,
+				       SND_SEQ_PORT_TYPE_MIDI_GENERIC |
+				       SND_SEQ_PORT_TYPE_APPLICATION);
+  seqQueue = snd_seq_alloc_named_queue(seq, "Ondes keyboard");
+  if ((seqPort < 0) || (seqQueue < 0) ||
+      (snd_seq_start_queue(seq, seqQueue, NULL) < 0) ||
+      (snd_seq_drain_output(seq) < 0) ||
+      (snd_seq_connect_from(seq, seqPort, SND_SEQ_CLIENT_SYSTEM,
+			    SND_SEQ_PORT_SYSTEM_ANNOUNCE) < 0)) {
+    fprintf(stderr, "Error: cannot set up the ALSA sequencer\n");
+    snd_seq_close(seq);
+    seq = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void seqDrain(uint32_t micros, midiInHandler handler) {
+  /* The queue's clock isn't ours, so each event's time is found from
+     how long before now it arrived */
+  snd_seq_queue_status_t *status;
+  snd_seq_event_t *sev;
+  midiEvent ev = { 0 };
+  int err;
+  if (snd_seq_event_input_pending(seq, 1) <= 0) return;
+  snd_seq_queue_status_alloca(&status);
+  if (snd_seq_get_queue_status(seq, seqQueue, status) < 0) return;
+  const snd_seq_real_time_t *now = snd_seq_queue_status_get_real_time(status);
+  while (-EAGAIN != (err = snd_seq_event_input(seq, &sev))) {
+    if (-ENOSPC == err) {
+      /* The input buffer overran and events were lost */
+      midiInLost++;
+      continue;
+    }
+    if (err < 0) return;
+    if (!seqEvent(sev, &ev)) {
+      seqAnnounce(sev, micros, handler);
+      continue;
+    }
+    int64_t age = ((int64_t) now->tv_sec - sev->time.time.tv_sec) * 1000000 +
+      ((int64_t) now->tv_nsec - sev->time.time.tv_nsec) / 1000;
+    ev.micros = micros - (uint32_t) ((age > 0) ? age : 0);
+    ev.track = seqInput(&sev->source);
+    addEvent(&ev, handler);
+  }
+}
+
+static void rawOpen(uint8_t i) {
+  midiInput *in = &inputs[i];
+  memset(&in->port, 0, sizeof(midiInPort));
+  in->port.fd = open(in->name, O_RDONLY | O_NONBLOCK);
+  in->connected = (in->port.fd >= 0);
+  if (in->connected) fprintf(stderr, "MIDI input %s connected\n", in->name);
+}
+
+static void rawDrain(uint8_t i, uint32_t micros, midiInHandler handler) {
+  /* Read and parse everything waiting. The messages are all given the
+     time now, when the device was found ready */
+  midiInput *in = &inputs[i];
+  uint8_t buf[256];
+  midiEvent ev = { 0 };
+  ev.micros = micros;
+  ev.track = i;
+  for (;;) {
+    ssize_t len = read(in->port.fd, buf, sizeof(buf));
+    if (len > 0) {
+      for (ssize_t j = 0; j < len; j++) {
+	if (midiInByte(&in->port, buf[j], &ev)) addEvent(&ev, handler);
+      }
+    } else if ((len < 0) && (EINTR == errno)) {
+      continue;
+    } else if ((len < 0) && (EAGAIN == errno)) {
+      return;
+    } else {
+      /* Unplugged */
+      close(in->port.fd);
+      in->port.fd = -1;
+      in->connected = 0;
+      release(i, micros, handler);
+      return;
+    }
+  }
+}
+
+uint8_t midiInByte(midiInPort *port, uint8_t b, midiEvent *ev) {
+  /* Add a byte to the message being parsed. Returns 1 with the message
+     in ev when a channel message is complete */
+  if (b >= 0xf8) {
+    /* Real time - clock, start, stop etc. - doesn't affect anything else */
+    return 0;
+  }
+  if (b & 0x80) {
+    port->count = 0;
+    if (b < 0xf0) {
+      port->status = b;
+      port->skip = 0;
+    } else {
+      /* SysEx and System Common end running status. Their data (and
+	 anything else until the next status byte) is skipped */
+      port->status = 0;
+      port->skip = (0xf7 != b);
+    }
+    return 0;
+  }
+  if (port->skip || !port->status) return 0;
+  port->data[port->count++] = b;
+  if (port->count < dataBytes(port->status)) return 0;
+
+  /* Complete - keep the status for the next message */
+  ev->status = port->status;
+  ev->data1  = port->data[0];
+  ev->data2  = (2 == port->count) ? port->data[1] : 0;
+  port->count = 0;
+  return 1;
+}
+
+int midiInOpen(const char *const *names, uint8_t count) {
+  /* Start listening to the inputs named: paths for raw devices, anything
+     else for sequencer ports. Those which aren't there yet are connected
+     when they appear. Returns -1 if the sequencer is needed and can't be
+     used */
+  uint8_t needSeq = 0;
+  inputCount = (count < MIDIIN_MAX) ? count : MIDIIN_MAX;
+  anyInput = -1;
+  anyCount = 0;
+  for (uint8_t i = 0; i < inputCount; i++) {
+    midiInput *in = &inputs[i];
+    memset(in, 0, sizeof(midiInput));
+    snprintf(in->name, sizeof(in->name), "%s", names[i]);
+    in->port.fd = -1;
+    in->raw = ('/' == in->name[0]);
+    if (0 == strcmp(in->name, "any")) anyInput = i;
+    if (in->raw) {
+      rawOpen(i);
+      if (!in->connected) fprintf(stderr, "Waiting for MIDI input %s\n", in->name);
+    } else {
+      needSeq = 1;
+    }
+  }
+  if (!needSeq) return 0;
+  if (seqOpen()) return -1;
+
+  for (uint8_t i = 0; i < inputCount; i++) {
+    if (!inputs[i].raw && (i != anyInput)) {
+      seqConnect(i);
+      if (!inputs[i].connected) {
+	fprintf(stderr, "Waiting for MIDI input %s\n", inputs[i].name);
+      }
+    }
+  }
+  if (anyInput >= 0) {
+    /* Every hardware port there already */
+    snd_seq_client_info_t *cinfo;
+    snd_seq_port_info_t *pinfo;
+    snd_seq_client_info_alloca(&cinfo);
+    snd_seq_port_info_alloca(&pinfo);
+    snd_seq_client_info_set_client(cinfo, -1);
+    while (snd_seq_query_next_client(seq, cinfo) >= 0) {
+      snd_seq_port_info_set_client(pinfo, snd_seq_client_info_get_client(cinfo));
+      snd_seq_port_info_set_port(pinfo, -1);
+      while (snd_seq_query_next_port(seq, pinfo) >= 0) seqConnectAny(pinfo);
+    }
+  }
+  return 0;
+}
+
+int midiInFds(struct pollfd *fds, int max) {
+  /* The descriptors to poll for input. Returns how many */
+  int n = 0;
+  if (seq && (n < max)) {
+    n += snd_seq_poll_descriptors(seq, fds, max, POLLIN);
+  }
+  for (uint8_t i = 0; (i < inputCount) && (n < max); i++) {
+    if (inputs[i].raw && inputs[i].connected) {
+      fds[n].fd = inputs[i].port.fd;
+      fds[n].events = POLLIN;
+      fds[n].revents = 0;
+      n++;
+    }
+  }
+  return n;
+}
+
+int midiInService(uint32_t micros, midiInHandler handler) {
+  /* Pass on everything waiting on any input, in time order. micros is
+     the time now. Never blocks. Returns the number of messages */
+  uint32_t before = midiInEvents;
+  if (seq) seqDrain(micros, handler);
+  for (uint8_t i = 0; i < inputCount; i++) {
+    if (inputs[i].raw && inputs[i].connected) rawDrain(i, micros, handler);
+  }
+  flush(handler);
+
+  /* Now and again look for a raw device which isn't there */
+  if ((micros - retryMicros) >= MIDIIN_RETRY_MILLIS * 1000) {
+    retryMicros = micros;
+    for (uint8_t i = 0; i < inputCount; i++) {
+      if (inputs[i].raw && !inputs[i].connected) rawOpen(i);
+    }
+  }
+  return midiInEvents - before;
+}
+
+void midiInClose(void) {
+  for (uint8_t i = 0; i < inputCount; i++) {
+    if (inputs[i].raw && inputs[i].connected) close(inputs[i].port.fd);
+    inputs[i].connected = 0;
+  }
+  inputCount = 0;
+  if (seq) snd_seq_close(seq);
+  seq = NULL;
+}
@@ -0,0 +1,57 @@
+/*
+  ondes_midiin.h
+
+  Streaming MIDI input from one or more USB keyboards, pedal boards,
+  breath controllers etc. Each input is either
+  - a raw MIDI device (/dev/snd/midiC1D0). Every byte waiting is read and
+    parsed as soon as the device is ready, so nothing is lost however
+    fast the notes come. The parser follows the MIDI 1.0 byte stream
+    rules: running status on any channel, real time bytes anywhere (even
+    inside other messages), and System Exclusive and System Common
+    messages skipped. Messages are stamped with the time they were read.
+  - or an ALSA sequencer port (e.g. "microKEY2-61" or "24:0", as listed by
+    aconnect -i), or "any" for every hardware MIDI port. These are all
+    subscribed through one real time queue, so that the kernel stamps
+    each event as it arrives. Other programs can use the keyboard at the
+    same time.
+  Inputs can come and go. Sequencer ports are connected as soon as the
+  system announces them, and a missing raw device is looked for every
+  MIDIIN_RETRY_MILLIS. When an input goes, an All Notes Off is passed on
+  for it so no key is left held.
+
+  The channel messages from all inputs are passed on as midiEvents, in
+  time order, with micros on the caller's clock and track set to the
+  input number (its place in the list given to midiInOpen()).
+*/
+
+#ifndef ONDES_MIDIIN_H
+#define ONDES_MIDIIN_H
+
+#include <stdint.h>
+#include <poll.h>
+#include "ondes_midifile.h"
+
+#define MIDIIN_MAX          8    // inputs that can be named
+#define MIDIIN_RETRY_MILLIS 2000 // how often to look for a missing device
+
+/* Parser state for a raw device */
+typedef struct {
+  int      fd;
+  uint8_t  status;  // running status, 0 if none
+  uint8_t  data[2];
+  uint8_t  count;   // data bytes so far
+  uint8_t  skip;    // in a SysEx or System Common message
+} midiInPort;
+
+typedef void (*midiInHandler)(const midiEvent *);
+
+extern uint32_t midiInEvents; // channel messages passed on
+extern uint32_t midiInLost;   // sequencer overruns, when events were lost
+
+int     midiInOpen(const char *const *, uint8_t);
+int     midiInFds(struct pollfd *, int);
+int     midiInService(uint32_t, midiInHandler);
+void    midiInClose(void);
+uint8_t midiInByte(midiInPort *, uint8_t, midiEvent *);
+
+#endif
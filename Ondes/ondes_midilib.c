@@ -0,0 +1,428 @@
+/*
+  ondes_midilib.c
+
+  Library of the MIDI files available to play. See ondes_midilib.h
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "ondes_midifile.h"
+#include "ondes_midilib.h"
+
+/* The main loop's copy, only changed by midiLibPoll() */
+midiLibEntry *midiLib = NULL;
+uint32_t      midiLibCount = 0;
+
+/* The library itself belongs to the thread, which parses new files and
+   saves the index away from the main loop, and hands a sorted copy over
+   through pending whenever it changes */
+static midiLibEntry *lib = NULL;
+static uint32_t      libCount = 0;
+static uint32_t      libSpace = 0;
+static uint8_t       libChanged = 0; // needs sorting and saving
+static midiLibEntry *pending = NULL;
+static uint32_t      pendingCount = 0;
+static uint8_t       pendingReady = 0;
+static pthread_mutex_t libLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t     libThread;
+static volatile uint8_t libRun = 0;
+
+static int         inotify_d = -1;
+static const char *libDirs[MIDILIB_DIRS];
+static int         libWatch[MIDILIB_DIRS]; // watch descriptor, -1 if none
+static uint8_t     libDirCount = 0;
+static uint32_t    checkMillis;
+
+/* The index saved by the last run. It is kept, so that a directory which
+   comes back (or has to be polled) isn't parsed all over again */
+static midiLibEntry *saved = NULL;
+static uint32_t      savedCount = 0;
+
+/* Files which didn't load, so they aren't tried again until they change */
+static midiLibEntry *rejected = NULL;
+static uint32_t      rejectedCount = 0;
+static uint32_t      rejectedSpace = 0;
+
+static uint32_t libMillis(void) {
+  struct timespec tm;
+  clock_gettime(CLOCK_MONOTONIC, &tm);
+  return (uint32_t) tm.tv_sec * 1000u + (uint32_t) (tm.tv_nsec / 1000000);
+}
+
+static int isMidiName(const char *name) {
+  /* Visible files ending .mid or .midi, in any case */
+  const char *ext = strrchr(name, '.');
+  return ('.' != name[0]) && ext &&
+    ((0 == strcasecmp(ext, ".mid")) || (0 == strcasecmp(ext, ".midi")));
+}
+
+static int byName(const void *a, const void *b) {
+  const midiLibEntry *ea = a, *eb = b;
+  int order = strcasecmp(ea->name, eb->name);
+  return (order) ? order : strcmp(ea->path, eb->path);
+}
+
+static void setPath(midiLibEntry *e, char *path) {
+  e->path = path;
+  e->name = strrchr(path, '/');
+  e->name = (e->name) ? e->name + 1 : path;
+}
+
+static void removeAt(uint32_t i) {
+  free(lib[i].path);
+  memmove(&lib[i], &lib[i + 1],
+	  (libCount - i - 1) * sizeof(midiLibEntry));
+  libCount--;
+  libChanged = 1;
+}
+
+static void removeFile(const char *path) {
+  for (uint32_t i = 0; i < libCount; i++) {
+    if (0 == strcmp(lib[i].path, path)) {
+      removeAt(i);
+      return;
+    }
+  }
+}
+
+static void removeDir(const char *dir) {
+  /* Forget every file in a directory which has gone, e.g. the USB stick
+     has been unmounted */
+  size_t len = strlen(dir);
+  for (uint32_t i = libCount; i > 0; i--) {
+    if ((0 == strncmp(lib[i - 1].path, dir, len)) &&
+	('/' == lib[i - 1].path[len])) removeAt(i - 1);
+  }
+}
+
+static void addFile(const char *dir, const char *name) {
+  /* Add a new or changed file, parsing it unless it is already listed
+     or in the saved index with the same time and size. A file which
+     doesn't load is left out, so it can't be chosen */
+  midiLibEntry e = { 0 };
+  struct stat sb;
+  char *path;
+  if (asprintf(&path, "%s/%s", dir, name) < 0) return;
+  if (stat(path, &sb) || !S_ISREG(sb.st_mode)) {
+    removeFile(path);
+    free(path);
+    return;
+  }
+  for (uint32_t i = 0; i < libCount; i++) {
+    if (0 == strcmp(lib[i].path, path)) {
+      if ((lib[i].mtime == sb.st_mtime) && (lib[i].size == sb.st_size)) {
+	free(path);
+	return;
+      }
+      removeAt(i);
+      break;
+    }
+  }
+  setPath(&e, path);
+  e.mtime = sb.st_mtime;
+  e.size = sb.st_size;
+
+  uint32_t i;
+  for (i = 0; i < rejectedCount; i++) {
+    if ((0 == strcmp(rejected[i].path, path)) &&
+	(rejected[i].mtime == e.mtime) && (rejected[i].size == e.size)) {
+      free(path);
+      return;
+    }
+  }
+  for (i = 0; i < savedCount; i++) {
+    if ((0 == strcmp(saved[i].path, path)) && (saved[i].mtime == e.mtime) &&
+	(saved[i].size == e.size)) break;
+  }
+  if (i < savedCount) {
+    e.micros = saved[i].micros;
+    e.qtrMicros = saved[i].qtrMicros;
+    e.tracks = saved[i].tracks;
+    strcpy(e.title, saved[i].title);
+  } else {
+    midiSong song;
+    if (midiLoad(path, &song) || (0 == song.count)) {
+      midiFree(&song);
+      fprintf(stderr, "%s is not a playable MIDI file - not listed\n", path);
+      if (rejectedCount == rejectedSpace) {
+	uint32_t space = (rejectedSpace) ? rejectedSpace * 2 : 16;
+	midiLibEntry *tmp = realloc(rejected, space * sizeof(midiLibEntry));
+	if (NULL == tmp) {
+	  free(path);
+	  return;
+	}
+	rejected = tmp;
+	rejectedSpace = space;
+      }
+      rejected[rejectedCount++] = e;
+      return;
+    }
+    e.micros = song.micros;
+    e.qtrMicros = song.qtrMicros;
+    e.tracks = song.tracks;
+    /* The title is shown on the LCD and saved one per line */
+    for (uint8_t j = 0; song.title[j]; j++) {
+      e.title[j] = ((uint8_t) song.title[j] < ' ') ? ' ' : song.title[j];
+    }
+    midiFree(&song);
+  }
+
+  if (libCount == libSpace) {
+    uint32_t space = (libSpace) ? libSpace * 2 : 64;
+    midiLibEntry *tmp = realloc(lib, space * sizeof(midiLibEntry));
+    if (NULL == tmp) {
+      free(path);
+      return;
+    }
+    lib = tmp;
+    libSpace = space;
+  }
+  lib[libCount++] = e;
+  libChanged = 1;
+}
+
+static void scanDir(uint8_t d) {
+  /* Watch a directory, then list what is already in it. If it can't be
+     watched this is called again every MIDILIB_MOUNT_MILLIS, so files
+     which have gone are dropped as well. Returns quietly if it isn't
+     there (yet) */
+  DIR *dir;
+  struct dirent *ent;
+  size_t len = strlen(libDirs[d]);
+  if (NULL == (dir = opendir(libDirs[d]))) {
+    removeDir(libDirs[d]);
+    return;
+  }
+  if (inotify_d >= 0) {
+    libWatch[d] = inotify_add_watch(inotify_d, libDirs[d],
+				    IN_CLOSE_WRITE | IN_MOVED_TO |
+				    IN_MOVED_FROM | IN_DELETE);
+  }
+  while ((ent = readdir(dir))) {
+    if (((DT_REG == ent->d_type) || (DT_UNKNOWN == ent->d_type)) &&
+	isMidiName(ent->d_name)) addFile(libDirs[d], ent->d_name);
+  }
+  closedir(dir);
+  for (uint32_t i = libCount; i > 0; i--) {
+    const char *path = lib[i - 1].path;
+    if ((0 == strncmp(path, libDirs[d], len)) && ('/' == path[len]) &&
+	access(path, F_OK)) removeAt(i - 1);
+  }
+}
+
+static void loadSaved(void) {
+  /* One file per line: time, size, length, tempo, tracks, title and
+     path, separated by tabs */
+  FILE *f = fopen(MIDILIB_CACHE, "r");
+  char line[600];
+  uint32_t space = 0;
+  if (NULL == f) return;
+  while (fgets(line, sizeof(line), f)) {
+    char *fields[7], *rest = line;
+    uint8_t n = 0;
+    line[strcspn(line, "\n")] = 0;
+    while ((n < 7) && rest) fields[n++] = strsep(&rest, "\t");
+    if ((n < 7) || ('/' != fields[6][0])) continue;
+    if (savedCount == space) {
+      space = (space) ? space * 2 : 64;
+      midiLibEntry *tmp = realloc(saved, space * sizeof(midiLibEntry));
+      if (NULL == tmp) break;
+      saved = tmp;
+    }
+    midiLibEntry *e = &saved[savedCount];
+    memset(e, 0, sizeof(midiLibEntry));
+    e->mtime = (time_t) strtoll(fields[0], NULL, 10);
+    e->size = (off_t) strtoll(fields[1], NULL, 10);
+    e->micros = strtoul(fields[2], NULL, 10);
+    e->qtrMicros = strtoul(fields[3], NULL, 10);
+    e->tracks = strtoul(fields[4], NULL, 10);
+    snprintf(e->title, sizeof(e->title), "%s", fields[5]);
+    if (NULL == (e->path = strdup(fields[6]))) break;
+    savedCount++;
+  }
+  fclose(f);
+}
+
+static void save(void) {
+  /* Written to a new file and renamed, so a power cut can't leave half
+     an index */
+  FILE *f = fopen(MIDILIB_CACHE ".new", "w");
+  if (NULL == f) return;
+  for (uint32_t i = 0; i < libCount; i++) {
+    const midiLibEntry *e = &lib[i];
+    fprintf(f, "%lld\t%lld\t%u\t%u\t%u\t%s\t%s\n", (long long) e->mtime,
+	    (long long) e->size, e->micros, e->qtrMicros, e->tracks,
+	    e->title, e->path);
+  }
+  if (0 == fclose(f)) rename(MIDILIB_CACHE ".new", MIDILIB_CACHE);
+}
+
+static void freeEntries(midiLibEntry *entries, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) free(entries[i].path);
+  free(entries);
+}
+
+static void tidy(void) {
+  /* Sort and save a changed library, and pass a copy of it on to the
+     main loop */
+  midiLibEntry *copy;
+  uint32_t i;
+  if (!libChanged) return;
+  qsort(lib, libCount, sizeof(midiLibEntry), byName);
+  save();
+  libChanged = 0;
+
+  if (NULL == (copy = malloc((libCount ? libCount : 1) *
+			     sizeof(midiLibEntry)))) return;
+  for (i = 0; i < libCount; i++) {
+    char *path = strdup(lib[i].path);
+    if (NULL == path) break;
+    copy[i] = lib[i];
+    setPath(&copy[i], path);
+  }
+  if (i < libCount) {
+    freeEntries(copy, i);
+    return;
+  }
+  pthread_mutex_lock(&libLock);
+  if (pendingReady) freeEntries(pending, pendingCount);
+  pending = copy;
+  pendingCount = libCount;
+  pendingReady = 1;
+  pthread_mutex_unlock(&libLock);
+}
+
+static void readEvents(void) {
+  /* Act on whatever inotify has to say, without waiting */
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  while ((len = read(inotify_d, buf, sizeof(buf))) > 0) {
+    const struct inotify_event *ev;
+    for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *) p;
+      uint8_t d;
+      for (d = 0; (d < libDirCount) && (libWatch[d] != ev->wd); d++);
+      if (d == libDirCount) continue;
+      if (ev->mask & (IN_IGNORED | IN_UNMOUNT)) {
+	/* The directory or the filesystem it is on has gone */
+	removeDir(libDirs[d]);
+	libWatch[d] = -1;
+      } else if (ev->len && isMidiName(ev->name)) {
+	if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+	  addFile(libDirs[d], ev->name);
+	} else {
+	  char *path;
+	  if (asprintf(&path, "%s/%s", libDirs[d], ev->name) >= 0) {
+	    removeFile(path);
+	    free(path);
+	  }
+	}
+      }
+    }
+  }
+}
+
+static void *libLoop(void *arg) {
+  /* Wait for inotify events, waking every MIDILIB_POLL_MILLIS to see if
+     it is time to stop */
+  struct pollfd pfd = { inotify_d, POLLIN, 0 };
+  (void) arg;
+  while (libRun) {
+    if (inotify_d >= 0) {
+      if (poll(&pfd, 1, MIDILIB_POLL_MILLIS) > 0) readEvents();
+    } else {
+      struct timespec nap = { 0, MIDILIB_POLL_MILLIS * 1000000L };
+      nanosleep(&nap, NULL);
+    }
+
+    /* Mounting a filesystem doesn't raise an event, so now and again
+       look for any directory which isn't being watched */
+    if ((libMillis() - checkMillis) >= MIDILIB_MOUNT_MILLIS) {
+      checkMillis = libMillis();
+      for (uint8_t d = 0; d < libDirCount; d++) {
+	if (libWatch[d] < 0) scanDir(d);
+      }
+    }
+    tidy();
+  }
+  return NULL;
+}
+
+int midiLibOpen(const char *const *dirs) {
+  /* Build the library from a NULL-terminated list of directories, any
+     of which may not exist yet (e.g. on a USB stick), then keep it up
+     to date from a thread of its own. Returns -1 if the directories
+     can't be watched, so are only looked at every MIDILIB_MOUNT_MILLIS,
+     or if the library can't be kept up to date at all */
+  loadSaved();
+  inotify_d = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  for (libDirCount = 0; dirs[libDirCount] && (libDirCount < MIDILIB_DIRS);
+       libDirCount++) {
+    libDirs[libDirCount] = dirs[libDirCount];
+    libWatch[libDirCount] = -1;
+    scanDir(libDirCount);
+  }
+  libChanged = 1;
+  tidy();
+  midiLibPoll();
+  checkMillis = libMillis();
+
+  libRun = 1;
+  if (pthread_create(&libThread, NULL, libLoop, NULL)) {
+    fprintf(stderr, "Failed to start the MIDI library thread\n");
+    libRun = 0;
+    return -1;
+  }
+  return (inotify_d < 0) ? -1 : 0;
+}
+
+void midiLibPoll(void) {
+  /* Call this regularly from the main loop to pick up any change to the
+     library. It never blocks - if the thread is busy handing a change
+     over, it is picked up next time */
+  if (pthread_mutex_trylock(&libLock)) return;
+  if (pendingReady) {
+    freeEntries(midiLib, midiLibCount);
+    midiLib = pending;
+    midiLibCount = pendingCount;
+    pending = NULL;
+    pendingReady = 0;
+  }
+  pthread_mutex_unlock(&libLock);
+}
+
+void midiLibClose(void) {
+  if (libRun) {
+    libRun = 0;
+    pthread_join(libThread, NULL);
+  }
+  if (inotify_d >= 0) close(inotify_d);
+  inotify_d = -1;
+  if (pendingReady) freeEntries(pending, pendingCount);
+  pending = NULL;
+  pendingReady = 0;
+  freeEntries(lib, libCount);
+  lib = NULL;
+  libCount = libSpace = 0;
+  freeEntries(saved, savedCount);
+  saved = NULL;
+  savedCount = 0;
+  freeEntries(rejected, rejectedCount);
+  rejected = NULL;
+  rejectedCount = rejectedSpace = 0;
+  freeEntries(midiLib, midiLibCount);
+  midiLib = NULL;
+  midiLibCount = 0;
+}
@@ -0,0 +1,45 @@
+/*
+  ondes_midilib.h
+
+  Library of the MIDI files available to play from the Play MIDI menu.
+  Each file is parsed when it is first seen, so only files which load
+  are listed, and their length, tempo, track count and title are known
+  without opening them again. inotify keeps the library up to date as
+  files are copied in, changed or deleted and as the USB stick comes and
+  goes. The index is saved so that unchanged files aren't parsed again
+  after a restart. After the first scan, files are parsed and the index
+  written by a thread of its own, and midiLibPoll() picks up the result,
+  so a stick full of new files doesn't hold up the main loop.
+*/
+
+#ifndef ONDES_MIDILIB_H
+#define ONDES_MIDILIB_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define MIDILIB_CACHE       "/home/pi/.ondesmidilib"
+#define MIDILIB_DIRS        4    // most directories that can be watched
+#define MIDILIB_MOUNT_MILLIS 2000 // how often to look for a missing directory
+#define MIDILIB_POLL_MILLIS  100  // how often the thread checks it should stop
+
+typedef struct {
+  char       *path;
+  const char *name;      // file name part of path
+  time_t      mtime;
+  off_t       size;
+  uint32_t    micros;    // length of the piece
+  uint32_t    qtrMicros; // tempo at the start
+  uint16_t    tracks;
+  char        title[33]; // name of the first track, if any
+} midiLibEntry;
+
+extern midiLibEntry *midiLib; // sorted by file name
+extern uint32_t      midiLibCount;
+
+int  midiLibOpen(const char *const *);
+void midiLibPoll(void);
+void midiLibClose(void);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+  ondes_midiout.c
+
+  Mirrors the performance to an ALSA sequencer port. See ondes_midiout.h
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+#include "ondes_midifile.h"
+#include "ondes_midiout.h"
+
+uint32_t midiOutSent = 0;
+uint32_t midiOutDropped = 0;
+uint32_t midiOutLate = 0;  // longest a message waited in the ring, in us
+
+static snd_seq_t *seq = NULL;
+static int        seqPort;
+static pthread_t  outThread;
+static volatile uint8_t outRun = 0;
+
+/* The ring. head is only written by the main loop and tail only by the
+   thread, each published with release ordering after the slot */
+static midiEvent ring[MIDIOUT_RING];
+static uint32_t  head = 0, tail = 0;
+
+static uint32_t nowMicros(void) {
+  /* The same clock as myMicros() in the servers */
+  struct timespec tm;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &tm);
+  return (uint32_t) ((uint64_t) tm.tv_sec * 1000000 + tm.tv_nsec / 1000);
+}
+
+void midiOutPush(uint32_t micros, uint8_t status, uint8_t data1,
+		 uint8_t data2) {
+  /* Queue a message from the main loop. Never blocks */
+  uint32_t h = head;
+  if (!outRun) return;
+  if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == MIDIOUT_RING) {
+    midiOutDropped++;
+    return;
+  }
+  midiEvent *ev = &ring[h & (MIDIOUT_RING - 1)];
+  ev->micros = micros;
+  ev->status = status;
+  ev->data1  = data1;
+  ev->data2  = data2;
+  __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+}
+
+static void sendEvent(const midiEvent *ev) {
+  snd_seq_event_t sev;
+  uint8_t chan = ev->status & 0x0f;
+  snd_seq_ev_clear(&sev);
+  snd_seq_ev_set_source(&sev, seqPort);
+  snd_seq_ev_set_subs(&sev);
+  snd_seq_ev_set_direct(&sev);
+  switch (ev->status & 0xf0) {
+  case 0x90:
+    snd_seq_ev_set_noteon(&sev, chan, ev->data1, ev->data2);
+    break;
+  case 0x80:
+    snd_seq_ev_set_noteoff(&sev, chan, ev->data1, ev->data2);
+    break;
+  case 0xb0:
+    snd_seq_ev_set_controller(&sev, chan, ev->data1, ev->data2);
+    break;
+  case 0xc0:
+    snd_seq_ev_set_pgmchange(&sev, chan, ev->data1);
+    break;
+  case 0xd0:
+    snd_seq_ev_set_chanpress(&sev, chan, ev->data1);
+    break;
+  case 0xe0:
+    snd_seq_ev_set_pitchbend(&sev, chan, ((ev->data2 << 7) | ev->data1) - 8192);
+    break;
+  default:
+    return;
+  }
+  snd_seq_event_output_direct(seq, &sev);
+}
+
+static void *outLoop(void *arg) {
+  /* Pass on whatever is in the ring, then sleep for a moment */
+  struct timespec nap = { 0, MIDIOUT_POLL_MICROS * 1000 };
+  (void) arg;
+  while (outRun) {
+    uint32_t t = tail, h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    if (t != h) {
+      uint32_t now = nowMicros();
+      for (; t != h; t++) {
+	const midiEvent *ev = &ring[t & (MIDIOUT_RING - 1)];
+	uint32_t late = now - ev->micros;
+	if ((late < 1000000) && (late > midiOutLate)) midiOutLate = late;
+	sendEvent(ev);
+	midiOutSent++;
+      }
+      __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+    }
+    nanosleep(&nap, NULL);
+  }
+  return NULL;
+}
+
+int midiOutOpen(const char *dest) {
+  /* Make the port, and connect it to dest if given (e.g. a DAW's input,
+     as listed by aconnect -o). Anything else can connect to it later */
+  if (seq) return 0;
+  if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0) < 0) {
+    fprintf(stderr, "Error: cannot open the ALSA sequencer for output\n");
+    seq = NULL;
+    return -1;
+  }
+  snd_seq_set_client_name(seq, "Ondes");
+  seqPort = snd_seq_create_simple_port(seq, "Performance",
+				       SND_SEQ_PORT_CAP_READ |
+				       SND_SEQ_PORT_CAP_SUBS_READ,
+				       SND_SEQ_PORT_TYPE_MIDI_GENERIC |
+				       SND_SEQ_PORT_TYPE_APPLICATION);
+  if (seqPort < 0) {
+    fprintf(stderr, "Error: cannot make the ALSA sequencer output port\n");
+    snd_seq_close(seq);
+    seq = NULL;
+    return -1;
+  }
+  if (dest && dest[0]) {
+    snd_seq_addr_t addr;
+    if ((snd_seq_parse_address(seq, &addr, dest) < 0) ||
+	(snd_seq_connect_to(seq, seqPort, addr.client, addr.port) < 0)) {
+      fprintf(stderr, "Cannot connect the MIDI mirror to %s\n", dest);
+    }
+  }
+  head = tail = 0;
+  outRun = 1;
+  if (pthread_create(&outThread, NULL, outLoop, NULL)) {
+    outRun = 0;
+    snd_seq_close(seq);
+    seq = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void midiOutClose(void) {
+  if (!seq) return;
+  outRun = 0;
+  pthread_join(outThread, NULL);
+  snd_seq_close(seq);
+  seq = NULL;
+}
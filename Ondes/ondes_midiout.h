@@ -0,0 +1,30 @@
+/*
+  ondes_midiout.h
+
+  Mirrors the performance to an ALSA sequencer port ("Ondes:Performance"),
+  so a DAW or another synth on the Pi can record or follow it. The keys,
+  Ruban (as 14-bit pitch bend), Touche and switches go out with the same
+  controllers as a recorded MIDI file (see ondes_midirec.c), which MIDI
+  playback understands.
+
+  The main loop only puts each message in a single producer, single
+  consumer ring, which needs no lock and no system call, and a thread of
+  its own passes them to the sequencer. If the ring is ever full the
+  message is dropped and counted rather than holding up the scan.
+*/
+
+#ifndef ONDES_MIDIOUT_H
+#define ONDES_MIDIOUT_H
+
+#include <stdint.h>
+
+#define MIDIOUT_RING       1024 // messages, a power of 2
+#define MIDIOUT_POLL_MICROS 500 // how often the thread looks at the ring
+
+extern uint32_t midiOutSent, midiOutDropped, midiOutLate;
+
+int  midiOutOpen(const char *);
+void midiOutClose(void);
+void midiOutPush(uint32_t, uint8_t, uint8_t, uint8_t);
+
+#endif
@@ -0,0 +1,285 @@
+/*
+  ondes_midirec.c
+
+  Records a live performance to a Standard MIDI File. See ondes_midirec.h
+
+  The mapping is the reverse of the one used for playback:
+    /key             Note On, and Note Off when the note changes or stops
+                     (key + 36 + octave shift, as PD plays it)
+    /sw voices       Program Change (bits 0-4 Ondes - Octaviant, 5-6 petit
+                     gambe & Souffle)
+    /sw diffuseurs   GPC 5 (80; 0x50)
+    Clavier / Ruban  GPC 6 (81; 0x51), Legato / Claquement GPC 7 (82; 0x52)
+    Touche           Channel Volume (7; 0x07)
+    level controls   GPC 1-4 (16-19; 0x10-0x13)
+    Expression       Expression MSB (11; 0x0B)
+    Feutre           GPC 8 (83; 0x53)
+    Ruban            Pitch Bend as absolute pitch in Ruban mode
+    vibrato          Pitch Bend from 8192 in Clavier mode
+  Analogue values are 10 bits and controllers 7, so levels lose their
+  bottom 3 bits. Only one of Ruban and vibrato can be recorded, as there
+  is one pitch bend, and the transposition buttons aren't recorded.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "ondes_midifile.h"
+#include "ondes_midirec.h"
+
+uint8_t midiRecOn = 0;
+midiRecSink midiRecMirror = NULL;
+
+static midiEvent *recEvents = NULL;
+static uint32_t   recCount = 0;
+static uint32_t   recSpace = 0;
+static uint32_t   recStart;     // time of the start of the take
+static uint8_t    recFull = 0;  // out of memory - the rest is lost
+
+/* What has been recorded so far, so only changes are added */
+static uint8_t  recCC[128];
+static uint8_t  recProgram;
+static uint16_t recBend;
+static int16_t  recNote;        // sounding note, or -1
+static uint8_t  recRuban;
+
+/* A finished take, handed to the writer thread */
+typedef struct {
+  midiEvent *events;
+  uint32_t   count;
+  char      *path;
+  char      *title;
+} midiTake;
+
+static void recAdd(uint32_t micros, uint8_t status, uint8_t data1,
+		   uint8_t data2) {
+  midiEvent *ev;
+  if (midiRecMirror) midiRecMirror(micros, status, data1 & 0x7f, data2 & 0x7f);
+  if (!midiRecOn || recFull) return;
+  if (recCount == recSpace) {
+    uint32_t space = recSpace * 2;
+    midiEvent *tmp = realloc(recEvents, space * sizeof(midiEvent));
+    if (NULL == tmp) {
+      fprintf(stderr, "Out of memory recording MIDI - take cut short\n");
+      recFull = 1;
+      return;
+    }
+    recEvents = tmp;
+    recSpace = space;
+  }
+  /* A scan's due time, or a MIDI input event's arrival, can be a little
+     before the take started */
+  int32_t offset = (int32_t) (micros - recStart);
+  ev = &recEvents[recCount++];
+  ev->micros = (offset < 0) ? 0 : offset;
+  ev->tick   = 0;
+  ev->status = status;
+  ev->data1  = data1 & 0x7f;
+  ev->data2  = data2 & 0x7f;
+  ev->track  = 0;
+}
+
+static void recCtrl(uint32_t micros, uint8_t cc, int val) {
+  if (val < 0) val = 0;
+  if (val > 127) val = 127;
+  if (recCC[cc] == val) return;
+  recCC[cc] = val;
+  recAdd(micros, 0xb0, cc, val);
+}
+
+static void recPitch(uint32_t micros, int bend) {
+  if (bend < 0) bend = 0;
+  if (bend > 16383) bend = 16383;
+  if (recBend == bend) return;
+  recBend = bend;
+  recAdd(micros, 0xe0, bend & 0x7f, bend >> 7);
+}
+
+void midiRecReset(void) {
+  /* Forget what has been sent, so everything is sent again as it is
+     next recorded */
+  memset(recCC, MIDI_UNSET, sizeof(recCC));
+  recProgram = MIDI_UNSET;
+  recBend = UINT16_MAX;
+  recNote = -1;
+  recRuban = 0;
+}
+
+int midiRecStart(uint32_t micros) {
+  /* Start a take. The caller should then record the whole current
+     state, which becomes the events at time 0 */
+  recSpace = 16384;
+  recCount = 0;
+  recFull = 0;
+  if (NULL == (recEvents = malloc(recSpace * sizeof(midiEvent)))) return -1;
+  recStart = micros;
+  midiRecReset();
+  midiRecOn = 1;
+  return 0;
+}
+
+void midiRecKey(uint32_t micros, int key, uint8_t play, int octaveShift) {
+  /* key and play as sent to PD in /key */
+  int note = key + 36 + octaveShift;
+  if (!(midiRecOn || midiRecMirror) || (note < 0) || (note > 127)) return;
+  if (play && (note == recNote)) return;
+  if (recNote >= 0) recAdd(micros, 0x80, recNote, 0);
+  recNote = -1;
+  if (play) {
+    recAdd(micros, 0x90, note, 100);
+    recNote = note;
+  }
+}
+
+void midiRecSw(uint32_t micros, uint8_t sw0, uint8_t sw1) {
+  /* The first two bytes of /sw. Clavier / Ruban and Legato /
+     Claquement go first, as they decide how the rest is played */
+  if (!(midiRecOn || midiRecMirror)) return;
+  recRuban = (sw1 & 4) ? 1 : 0;
+  recCtrl(micros, 0x51, (recRuban) ? 127 : 0);
+  recCtrl(micros, 0x52, (sw1 & 8) ? 127 : 0);
+  uint8_t program = ((sw0 >> 3) & 0x1f) | ((sw1 & 3) << 5);
+  if (program != recProgram) {
+    recProgram = program;
+    recAdd(micros, 0xc0, program, 0);
+  }
+  recCtrl(micros, 0x50, sw1 >> 4);
+}
+
+void midiRecAnlg(uint32_t micros, const int16_t *anlg, int octaveShift) {
+  /* The eight values of /anlg */
+  if (!(midiRecOn || midiRecMirror)) return;
+  recCtrl(micros, 0x07, anlg[0] >> 3);
+  for (uint8_t i = 2; i < 6; i++) recCtrl(micros, 0x0e + i, anlg[i] >> 3);
+  recCtrl(micros, 0x0b, (anlg[6] * 383 + 496) / 992);
+  recCtrl(micros, 0x53, anlg[7] >> 3);
+  if (recRuban) {
+    /* PD plays the ribbon as note 36 + oct + ribbon * 0.0994 - 4.6, and
+       a file's pitch bend as note 36 + oct + bend / 170.67 - 24 - oct */
+    recPitch(micros, (int) ((anlg[1] * 0.0994 - 4.6 + 24 + octaveShift) *
+			    170.6666667 + 0.5));
+  }
+}
+
+void midiRecVib(uint32_t micros, int16_t vib) {
+  if ((midiRecOn || midiRecMirror) && !recRuban) recPitch(micros, vib + 8193);
+}
+
+static uint8_t *putVarLen(uint8_t *p, uint32_t val) {
+  uint8_t bytes[5];
+  int8_t n = 0;
+  do {
+    bytes[n++] = val & 0x7f;
+    val >>= 7;
+  } while (val);
+  while (--n > 0) *p++ = bytes[n] | 0x80;
+  *p++ = bytes[0];
+  return p;
+}
+
+static uint8_t *putBE32(uint8_t *p, uint32_t val) {
+  *p++ = val >> 24;
+  *p++ = val >> 16;
+  *p++ = val >> 8;
+  *p++ = val;
+  return p;
+}
+
+static void *writeTake(void *arg) {
+  /* Encode a take as a format 0 file and write it under a temporary
+     name, then rename it so nothing sees half a file */
+  midiTake *take = arg;
+  size_t titleLen = strlen(take->title);
+  if (titleLen > 127) titleLen = 127;
+  size_t size = 14 + 8 + 7 + 4 + titleLen + (size_t) take->count * 8 + 4;
+  uint8_t *data = malloc(size), *p, *track;
+  uint32_t lastTick = 0;
+  char *tmpPath = NULL;
+  FILE *f;
+
+  if ((NULL == data) || (asprintf(&tmpPath, "%s.tmp", take->path) < 0)) {
+    fprintf(stderr, "Out of memory writing %s\n", take->path);
+    goto finished;
+  }
+  p = data;
+  memcpy(p, "MThd", 4);
+  p = putBE32(p + 4, 6);
+  *p++ = 0; *p++ = 0;  // format 0
+  *p++ = 0; *p++ = 1;  // 1 track
+  *p++ = MIDIREC_DIVISION >> 8;
+  *p++ = MIDIREC_DIVISION & 0xff;
+  memcpy(p, "MTrk", 4);
+  p += 8;
+  track = p;
+  *p++ = 0; *p++ = 0xff; *p++ = 0x51; *p++ = 3;
+  *p++ = MIDIREC_TEMPO >> 16;
+  *p++ = (MIDIREC_TEMPO >> 8) & 0xff;
+  *p++ = MIDIREC_TEMPO & 0xff;
+  *p++ = 0; *p++ = 0xff; *p++ = 0x03; *p++ = titleLen;
+  memcpy(p, take->title, titleLen);
+  p += titleLen;
+  for (uint32_t i = 0; i < take->count; i++) {
+    const midiEvent *ev = &take->events[i];
+    uint32_t tick = (uint64_t) ev->micros * MIDIREC_DIVISION / MIDIREC_TEMPO;
+    if (tick < lastTick) tick = lastTick;
+    p = putVarLen(p, tick - lastTick);
+    lastTick = tick;
+    *p++ = ev->status;
+    *p++ = ev->data1;
+    if (0xc0 != ev->status) *p++ = ev->data2;
+  }
+  *p++ = 0; *p++ = 0xff; *p++ = 0x2f; *p++ = 0;
+  putBE32(track - 4, p - track);
+
+  int failed = (NULL == (f = fopen(tmpPath, "wb")));
+  if (!failed) {
+    failed = (fwrite(data, 1, p - data, f) != (size_t) (p - data));
+    failed |= fclose(f);
+  }
+  if (failed || rename(tmpPath, take->path)) {
+    fprintf(stderr, "Failed to write %s\n", take->path);
+    remove(tmpPath);
+  }
+
+ finished:
+  free(tmpPath);
+  free(data);
+  free(take->events);
+  free(take->path);
+  free(take->title);
+  free(take);
+  return NULL;
+}
+
+int midiRecStop(const char *path, const char *title) {
+  /* End the take and write it to path in the background. Returns -1 if
+     there was nothing to write or it couldn't be started */
+  pthread_t writer;
+  midiTake *take;
+  if (!midiRecOn) return -1;
+  midiRecOn = 0;
+  if ((0 == recCount) || (NULL == (take = malloc(sizeof(midiTake))))) {
+    free(recEvents);
+    recEvents = NULL;
+    return -1;
+  }
+  take->events = recEvents;
+  take->count  = recCount;
+  take->path   = strdup(path);
+  take->title  = strdup(title);
+  recEvents = NULL;
+  if ((NULL == take->path) || (NULL == take->title) ||
+      pthread_create(&writer, NULL, writeTake, take)) {
+    free(take->events);
+    free(take->path);
+    free(take->title);
+    free(take);
+    return -1;
+  }
+  pthread_detach(writer);
+
+  return 0;
+}
@@ -0,0 +1,40 @@
+/*
+  ondes_midirec.h
+
+  Records a live performance to a Standard MIDI File, using the same
+  controller mapping that MIDI playback understands (see playMidiFile()
+  in the servers), so a take can be played back or rendered again.
+  Events are stamped with the time the scan that produced them was due
+  and collected in memory. The file is only encoded and written after
+  the recording stops, on a thread of its own, so there is no file I/O
+  on the control path.
+
+  The same events can be mirrored as they happen, by setting
+  midiRecMirror to a function to pass them to (see ondes_midiout.c).
+
+  Call everything except midiRecStop() from the main loop only.
+*/
+
+#ifndef ONDES_MIDIREC_H
+#define ONDES_MIDIREC_H
+
+#include <stdint.h>
+
+/* 120 crotchets a minute with 5000 ticks each, so a tick is 100us */
+#define MIDIREC_TEMPO    500000
+#define MIDIREC_DIVISION 5000
+
+typedef void (*midiRecSink)(uint32_t, uint8_t, uint8_t, uint8_t);
+
+extern uint8_t     midiRecOn;
+extern midiRecSink midiRecMirror;
+
+void midiRecReset(void);
+int  midiRecStart(uint32_t);
+int  midiRecStop(const char *, const char *);
+void midiRecKey(uint32_t, int, uint8_t, int);
+void midiRecSw(uint32_t, uint8_t, uint8_t);
+void midiRecAnlg(uint32_t, const int16_t *, int);
+void midiRecVib(uint32_t, int16_t);
+
+#endif
@@ -0,0 +1,393 @@
+/*
+  ondes_midisync.c
+
+  MIDI Clock and MIDI Time Code sync. See ondes_midisync.h
+
+  Positions within the song are measured in MIDI clocks (24 to the
+  crotchet) from the start, and in MTC quarter frames (4 to the frame).
+  Song Position Pointer counts sixteenths, i.e. 6 clocks.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include "ondes_midifile.h"
+#include "ondes_midisync.h"
+
+#define QUARTER_FRAME_MICROS (1000000 / (SYNC_MTC_FPS * 4))
+
+uint8_t midiSyncMode = 0;
+
+static int sync_d = -1;
+static pthread_t syncThread;
+static uint8_t   threadRunning = 0;
+static volatile uint8_t syncDone = 0;
+static pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  syncCond; // on CLOCK_MONOTONIC, like playback
+
+/* Master - the timebase from midiSyncPlay(). originMicros into the song
+   sounds at originNanos, and sending starts from fromMicros */
+static uint8_t   running = 0;
+static uint32_t  generation = 0;  // changes with every midiSyncPlay()
+static uint64_t  originNanos;
+static uint32_t  originMicros;
+static uint32_t  fromMicros;
+static const midiSong *song = NULL;
+
+/* Slave - the position from the clock received. The last clock received
+   is at sppBase + clocksIn - 1 */
+static uint8_t   following = 0;
+static uint8_t   moved = 0;
+static uint8_t   stopped = 0;
+static uint32_t  sppBase = 0;
+static uint32_t  clocksIn = 0;
+static uint64_t  lastClockNanos = 0;
+
+/* Timing, for midiSyncReport() */
+static uint32_t  sentCount = 0;
+static uint64_t  lateSum = 0, lateMax = 0;
+static uint32_t  intervalCount = 0;
+static double    intervalMean = 0.0, intervalM2 = 0.0, intervalDevMax = 0.0;
+
+static uint64_t syncNanos(void) {
+  struct timespec tm;
+  clock_gettime(CLOCK_MONOTONIC, &tm);
+  return (uint64_t) tm.tv_sec * 1000000000ULL + tm.tv_nsec;
+}
+
+static void syncWrite(const uint8_t *msg, size_t len) {
+  static uint8_t warned = 0;
+  if ((write(sync_d, msg, len) != (ssize_t) len) && !warned) {
+    fprintf(stderr, "Failed to write to the MIDI sync port\n");
+    warned = 1;
+  }
+}
+
+static const midiTempo *tempoAtMicros(uint32_t micros) {
+  /* The last tempo change at or before a time */
+  uint32_t lo = 0, hi = song->tempoCount;
+  while (hi - lo > 1) {
+    uint32_t mid = (lo + hi) / 2;
+    if (song->tempos[mid].micros <= micros) lo = mid; else hi = mid;
+  }
+  return &song->tempos[lo];
+}
+
+static uint32_t clockAt(uint32_t micros) {
+  /* The last clock at or before a time in the song */
+  const midiTempo *t = tempoAtMicros(micros);
+  uint64_t ticks24 = (uint64_t) t->tick * 24 +
+    (uint64_t) (micros - t->micros) * 24 * song->ticksPerQtr / t->qtrMicros;
+  return (uint32_t) (ticks24 / song->ticksPerQtr);
+}
+
+static uint32_t clockMicros(uint32_t clock) {
+  /* The time of a clock in the song, following the tempo map */
+  uint64_t ticks24 = (uint64_t) clock * song->ticksPerQtr;
+  uint32_t lo = 0, hi = song->tempoCount;
+  while (hi - lo > 1) {
+    uint32_t mid = (lo + hi) / 2;
+    if ((uint64_t) song->tempos[mid].tick * 24 <= ticks24) lo = mid; else hi = mid;
+  }
+  const midiTempo *t = &song->tempos[lo];
+  return t->micros + (uint32_t) ((ticks24 - (uint64_t) t->tick * 24) *
+				 t->qtrMicros / (24 * song->ticksPerQtr));
+}
+
+static uint64_t dueNanos(uint32_t micros) {
+  /* When a time in the song sounds. Anything before the origin (clocks
+     to catch up after a Song Position Pointer) is due straight away */
+  if (micros < originMicros) return originNanos;
+  return originNanos + (uint64_t) (micros - originMicros) * 1000;
+}
+
+static void sendFullFrame(uint32_t micros) {
+  uint32_t frames = (uint64_t) micros * SYNC_MTC_FPS / 1000000;
+  uint8_t msg[10] = { 0xf0, 0x7f, 0x7f, 0x01, 0x01,
+		      (SYNC_MTC_RATE << 5) | (frames / (SYNC_MTC_FPS * 3600) % 24),
+		      frames / (SYNC_MTC_FPS * 60) % 60,
+		      frames / SYNC_MTC_FPS % 60,
+		      frames % SYNC_MTC_FPS, 0xf7 };
+  syncWrite(msg, sizeof(msg));
+}
+
+static void sendQuarterFrame(uint32_t qf) {
+  /* Each group of 8 quarter frames carries the time of the frame in
+     which the first was sent */
+  uint8_t piece = qf & 7;
+  uint32_t frames = (qf - piece) / 4;
+  uint8_t hh = frames / (SYNC_MTC_FPS * 3600) % 24;
+  uint8_t val[8] = { frames % SYNC_MTC_FPS, 0, frames / SYNC_MTC_FPS % 60, 0,
+		     frames / (SYNC_MTC_FPS * 60) % 60, 0, hh, 0 };
+  uint8_t nibble = (piece & 1) ? val[piece - 1] >> 4 : val[piece] & 0x0f;
+  if (7 == piece) nibble = (hh >> 4) | (SYNC_MTC_RATE << 1);
+  uint8_t msg[2] = { 0xf1, (piece << 4) | nibble };
+  syncWrite(msg, 2);
+}
+
+static void waitUntil(uint64_t nanos) {
+  struct timespec tm;
+  tm.tv_sec = nanos / 1000000000ULL;
+  tm.tv_nsec = nanos % 1000000000ULL;
+  pthread_cond_timedwait(&syncCond, &syncLock, &tm);
+}
+
+static void *sendSync(void *arg) {
+  /* Master thread: send each clock and quarter frame when it is due,
+     starting again whenever midiSyncPlay() moves the timebase */
+  uint32_t gen = generation - 1, clock = 0, qf = 0;
+  (void) arg;
+  pthread_mutex_lock(&syncLock);
+  while (!syncDone) {
+    if (!running) {
+      pthread_cond_wait(&syncCond, &syncLock);
+      continue;
+    }
+    if (gen != generation) {
+      gen = generation;
+      if (song) clock = clockAt(fromMicros) / 6 * 6;
+      qf = (fromMicros + QUARTER_FRAME_MICROS - 1) / QUARTER_FRAME_MICROS;
+      qf = (qf + 7) & ~7u;
+    }
+    uint64_t clockDue = ((midiSyncMode & SYNC_CLOCK) && song) ?
+      dueNanos(clockMicros(clock)) : UINT64_MAX;
+    uint64_t qfDue = (midiSyncMode & SYNC_MTC) ?
+      dueNanos(qf * QUARTER_FRAME_MICROS) : UINT64_MAX;
+    uint64_t due = (clockDue < qfDue) ? clockDue : qfDue;
+    if (UINT64_MAX == due) {
+      pthread_cond_wait(&syncCond, &syncLock);
+      continue;
+    }
+    uint64_t now = syncNanos();
+    if (now < due) {
+      waitUntil(due);
+      continue;
+    }
+    if (due == clockDue) {
+      const uint8_t msg = 0xf8;
+      syncWrite(&msg, 1);
+      clock++;
+    } else {
+      sendQuarterFrame(qf++);
+    }
+    uint64_t late = syncNanos() - due;
+    sentCount++;
+    lateSum += late;
+    if (late > lateMax) lateMax = late;
+  }
+  pthread_mutex_unlock(&syncLock);
+  return NULL;
+}
+
+static void clockIn(uint64_t now) {
+  /* Measure the interval from the last clock, against the running mean
+     of the intervals so far (Welford) */
+  if (lastClockNanos) {
+    double interval = (now - lastClockNanos) / 1000.0;
+    double dev = fabs(interval - intervalMean);
+    if (intervalCount && (dev > intervalDevMax)) intervalDevMax = dev;
+    intervalCount++;
+    double delta = interval - intervalMean;
+    intervalMean += delta / intervalCount;
+    intervalM2 += delta * (interval - intervalMean);
+  }
+  lastClockNanos = now;
+  clocksIn++;
+}
+
+static void *readSync(void *arg) {
+  /* Slave thread: follow the clock and transport from the port. Other
+     messages are ignored, except that their data bytes are skipped */
+  struct pollfd pfd = { sync_d, POLLIN, 0 };
+  uint8_t buf[64], status = 0, data[2], nData = 0;
+  (void) arg;
+  while (!syncDone) {
+    if (poll(&pfd, 1, 100) <= 0) continue;
+    ssize_t len = read(sync_d, buf, sizeof(buf));
+    uint64_t now = syncNanos();
+    if (len <= 0) continue;
+    pthread_mutex_lock(&syncLock);
+    for (ssize_t i = 0; i < len; i++) {
+      uint8_t b = buf[i];
+      if (b >= 0xf8) {
+	/* Real time messages can come anywhere, even inside others */
+	if ((0xf8 == b) && following) {
+	  clockIn(now);
+	} else if (0xfa == b) {          // Start
+	  sppBase = clocksIn = 0;
+	  following = moved = 1;
+	  lastClockNanos = 0;
+	} else if (0xfb == b) {          // Continue
+	  following = 1;
+	  lastClockNanos = 0;
+	} else if ((0xfc == b) && following) { // Stop
+	  sppBase += clocksIn;
+	  clocksIn = 0;
+	  following = 0;
+	  stopped = 1;
+	}
+      } else if (b & 0x80) {
+	status = b;
+	nData = 0;
+      } else if (0xf2 == status) {       // Song Position Pointer
+	data[nData++] = b;
+	if (2 == nData) {
+	  sppBase = ((data[1] << 7) | data[0]) * 6;
+	  clocksIn = 0;
+	  moved = 1;
+	  status = 0;
+	}
+      }
+    }
+    pthread_cond_broadcast(&syncCond);
+    pthread_mutex_unlock(&syncLock);
+  }
+  return NULL;
+}
+
+int midiSyncOpen(const char *device, uint8_t mode) {
+  /* Open the sync port (e.g. /dev/snd/midiC2D0) and start its thread.
+     Following and sending are alternatives - following wins */
+  pthread_condattr_t attr;
+  if (mode & SYNC_FOLLOW) mode = SYNC_FOLLOW;
+  if (!mode) return -1;
+  sync_d = open(device, (mode & SYNC_FOLLOW) ? O_RDWR | O_NONBLOCK : O_WRONLY);
+  if (sync_d < 0) {
+    fprintf(stderr, "Error: cannot open MIDI sync port %s\n", device);
+    return -1;
+  }
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&syncCond, &attr);
+  pthread_condattr_destroy(&attr);
+  midiSyncMode = mode;
+  syncDone = 0;
+  if (pthread_create(&syncThread, NULL,
+		     (mode & SYNC_FOLLOW) ? readSync : sendSync, NULL)) {
+    fprintf(stderr, "Failed to start the MIDI sync thread\n");
+    midiSyncClose();
+    return -1;
+  }
+  threadRunning = 1;
+
+  return 0;
+}
+
+void midiSyncClose(void) {
+  midiSyncStop();
+  pthread_mutex_lock(&syncLock);
+  syncDone = 1;
+  pthread_cond_broadcast(&syncCond);
+  pthread_mutex_unlock(&syncLock);
+  if (threadRunning) pthread_join(syncThread, NULL);
+  threadRunning = 0;
+  if (sync_d >= 0) close(sync_d);
+  sync_d = -1;
+  midiSyncMode = 0;
+}
+
+void midiSyncPlay(uint64_t nanos, uint32_t micros, uint32_t from,
+		  const midiSong *s) {
+  /* Playback (or a recording, with no song) has started or moved on its
+     own clock: micros into the song sounds at nanos (a myNanos() time),
+     and it goes on from the time from. Following, it means go to
+     wherever the master is */
+  if (sync_d < 0) return;
+  pthread_mutex_lock(&syncLock);
+  if (midiSyncMode & SYNC_FOLLOW) {
+    moved = 1;
+    pthread_mutex_unlock(&syncLock);
+    return;
+  }
+  song = (s && s->tempoCount && s->ticksPerQtr) ? s : NULL;
+  originNanos = nanos;
+  originMicros = micros;
+  fromMicros = from;
+  if ((midiSyncMode & SYNC_CLOCK) && song) {
+    uint32_t spp = clockAt(from) / 6;
+    if (spp > 0x3fff) spp = 0x3fff;
+    if (spp) {
+      uint8_t msg[4] = { 0xf2, spp & 0x7f, spp >> 7, 0xfb };
+      syncWrite(msg, 4);
+    } else {
+      const uint8_t msg = 0xfa;
+      syncWrite(&msg, 1);
+    }
+  }
+  if (midiSyncMode & SYNC_MTC) sendFullFrame(from);
+  running = 1;
+  generation++;
+  pthread_cond_broadcast(&syncCond);
+  pthread_mutex_unlock(&syncLock);
+}
+
+void midiSyncStop(void) {
+  /* Playback (or recording) has paused or stopped */
+  if (sync_d < 0) return;
+  pthread_mutex_lock(&syncLock);
+  if (running && song && (midiSyncMode & SYNC_CLOCK)) {
+    const uint8_t msg = 0xfc;
+    syncWrite(&msg, 1);
+  }
+  running = 0;
+  pthread_cond_broadcast(&syncCond);
+  pthread_mutex_unlock(&syncLock);
+}
+
+int midiSyncWait(uint32_t tick, uint16_t ticksPerQtr, uint32_t *pos,
+		 uint32_t micros) {
+  /* Following, wait up to micros for the clock to reach a tick of the
+     song. After SYNC_MOVED, *pos is the tick to carry on from */
+  uint64_t until = syncNanos() + (uint64_t) micros * 1000;
+  int ret = SYNC_WAITING;
+  pthread_mutex_lock(&syncLock);
+  do {
+    if (moved) {
+      uint32_t clock = (clocksIn) ? sppBase + clocksIn - 1 : sppBase;
+      *pos = (uint64_t) clock * ticksPerQtr / 24;
+      moved = 0;
+      ret = SYNC_MOVED;
+      break;
+    }
+    if (stopped) {
+      stopped = 0;
+      ret = SYNC_STOPPED;
+      break;
+    }
+    if (following && clocksIn &&
+	((uint64_t) (sppBase + clocksIn - 1) * ticksPerQtr >=
+	 (uint64_t) tick * 24)) {
+      ret = SYNC_DUE;
+      break;
+    }
+    waitUntil(until);
+  } while (syncNanos() < until);
+  pthread_mutex_unlock(&syncLock);
+  return ret;
+}
+
+void midiSyncReport(FILE *f) {
+  /* How late the clock and time code went out, or how steady the clock
+     coming in was, since the last report */
+  pthread_mutex_lock(&syncLock);
+  if (sentCount) {
+    fprintf(f, "MIDI sync: %u sent, late by %.0fus mean, %.0fus max\n",
+	    sentCount, lateSum / 1000.0 / sentCount, lateMax / 1000.0);
+  }
+  if (intervalCount > 1) {
+    fprintf(f, "MIDI sync: %u clocks received, %.1f bpm, jitter %.0fus sd, %.0fus max\n",
+	    intervalCount + 1, 60.0e6 / (intervalMean * 24),
+	    sqrt(intervalM2 / (intervalCount - 1)), intervalDevMax);
+  }
+  sentCount = intervalCount = 0;
+  lateSum = lateMax = 0;
+  intervalMean = intervalM2 = intervalDevMax = 0.0;
+  pthread_mutex_unlock(&syncLock);
+}
@@ -0,0 +1,49 @@
+/*
+  ondes_midisync.h
+
+  MIDI Clock and MIDI Time Code for MIDI playback, so that the Ondes can
+  lead a sequencer or drum machine, or follow one, e.g. to record against
+  an accompaniment. The sync port is a raw MIDI device: a USB MIDI
+  interface, or a snd-virmidi port to reach a sequencer on the same Pi
+  through the ALSA sequencer.
+
+  As master, a thread of its own sends Start, Stop, Continue and Song
+  Position Pointer with the transport, and Clock (following the file's
+  tempo map) and/or MTC quarter frames, each written at the time it is
+  due on the same CLOCK_MONOTONIC timebase that playback sleeps on. As
+  slave, it reads Clock and the transport from the port, and playback
+  waits for the clock to reach each event's tick instead of using its own
+  clock. Either way the timing is measured and can be reported.
+*/
+
+#ifndef ONDES_MIDISYNC_H
+#define ONDES_MIDISYNC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "ondes_midifile.h"
+
+/* Modes, from the 'sync' line in the config file */
+#define SYNC_CLOCK  1   // send MIDI Clock and the transport
+#define SYNC_MTC    2   // send MIDI Time Code
+#define SYNC_FOLLOW 4   // follow MIDI Clock from the port
+
+#define SYNC_MTC_FPS  25
+#define SYNC_MTC_RATE 1 // rate code for 25fps in the hours byte
+
+/* Results of midiSyncWait() */
+#define SYNC_DUE     0  // the clock has reached the tick
+#define SYNC_MOVED   1  // Start or Song Position Pointer - see the position
+#define SYNC_STOPPED 2  // Stop
+#define SYNC_WAITING 3  // timed out, so check whether to give up
+
+extern uint8_t midiSyncMode;
+
+int  midiSyncOpen(const char *, uint8_t);
+void midiSyncClose(void);
+void midiSyncPlay(uint64_t, uint32_t, uint32_t, const midiSong *);
+void midiSyncStop(void);
+int  midiSyncWait(uint32_t, uint16_t, uint32_t *, uint32_t);
+void midiSyncReport(FILE *);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+  ondes_mpe.c
+
+  MPE output. See ondes_mpe.h
+*/
+
+#include <stdint.h>
+#include <math.h>
+#include "ondes_midiout.h"
+#include "ondes_mpe.h"
+
+uint8_t  mpeOn = 0;
+uint32_t mpePeriod = 5000;
+
+/* The note sounding, if any, and what has been sent for it */
+static int8_t   mpeChan = -1;     // its member channel, -1 if none
+static uint8_t  mpeNext = 0;      // member channel for the next note
+static uint8_t  mpeNote;
+static uint16_t sentBend;
+static uint8_t  sentPressure, sentTimbre;
+static uint32_t bendMicros, pressureMicros, timbreMicros;
+
+static void rpn(uint32_t micros, uint8_t chan, uint8_t param, uint8_t msb,
+		uint8_t lsb) {
+  /* Set a Registered Parameter, then deselect it */
+  midiOutPush(micros, 0xb0 | chan, 101, 0);
+  midiOutPush(micros, 0xb0 | chan, 100, param);
+  midiOutPush(micros, 0xb0 | chan, 6, msb);
+  midiOutPush(micros, 0xb0 | chan, 38, lsb);
+  midiOutPush(micros, 0xb0 | chan, 101, 127);
+  midiOutPush(micros, 0xb0 | chan, 100, 127);
+}
+
+void mpeStart(uint32_t micros) {
+  /* Configure the zone (the MPE Configuration Message is RPN 6 on the
+     master channel) and the pitch bend range of the member channels */
+  rpn(micros, 0, 6, MPE_MEMBERS, 0);
+  for (uint8_t i = 1; i <= MPE_MEMBERS; i++) {
+    rpn(micros, i, 0, MPE_BEND_RANGE, 0);
+  }
+  mpeChan = -1;
+  mpeOn = 1;
+}
+
+static uint16_t bendFor(float pitch) {
+  int bend = (int) lrintf(8192 + (pitch - mpeNote) * 8192 / MPE_BEND_RANGE);
+  if (bend < 0) bend = 0;
+  if (bend > 16383) bend = 16383;
+  return bend;
+}
+
+static void noteOff(uint32_t micros) {
+  if (mpeChan < 0) return;
+  midiOutPush(micros, 0x80 | mpeChan, mpeNote, 0);
+  mpeChan = -1;
+}
+
+void mpeFrame(uint32_t micros, int note, float pitch, uint8_t play,
+	      uint8_t pressure, uint8_t timbre) {
+  /* The state of the instrument: the note played (or -1 to glide from
+     the nearest note to where the pitch started, as on the Ruban), its
+     exact pitch as a MIDI note number, whether it is sounding, and the
+     pressure and timbre, 0 - 127 */
+  if (!mpeOn) return;
+  if (!play) {
+    noteOff(micros);
+    return;
+  }
+  if ((mpeChan < 0) || ((note >= 0) && (note != mpeNote))) {
+    /* A new note on the next member channel, its expression first */
+    noteOff(micros);
+    if (note < 0) note = (int) lrintf(pitch);
+    if (note < 0) note = 0;
+    if (note > 127) note = 127;
+    mpeNote = note;
+    mpeChan = 1 + mpeNext;
+    mpeNext = (mpeNext + 1) % MPE_MEMBERS;
+    sentBend = bendFor(pitch);
+    sentPressure = pressure;
+    sentTimbre = timbre;
+    bendMicros = pressureMicros = timbreMicros = micros;
+    midiOutPush(micros, 0xe0 | mpeChan, sentBend & 0x7f, sentBend >> 7);
+    midiOutPush(micros, 0xd0 | mpeChan, sentPressure, 0);
+    midiOutPush(micros, 0xb0 | mpeChan, MPE_TIMBRE, sentTimbre);
+    midiOutPush(micros, 0x90 | mpeChan, mpeNote,
+		(pressure) ? pressure : 1);
+    return;
+  }
+
+  /* The same note - send only what has changed, and not too often */
+  uint16_t bend = bendFor(pitch);
+  if ((bend != sentBend) && ((micros - bendMicros) >= mpePeriod)) {
+    sentBend = bend;
+    bendMicros = micros;
+    midiOutPush(micros, 0xe0 | mpeChan, bend & 0x7f, bend >> 7);
+  }
+  if ((pressure != sentPressure) &&
+      ((micros - pressureMicros) >= mpePeriod)) {
+    sentPressure = pressure;
+    pressureMicros = micros;
+    midiOutPush(micros, 0xd0 | mpeChan, pressure, 0);
+  }
+  if ((timbre != sentTimbre) && ((micros - timbreMicros) >= mpePeriod)) {
+    sentTimbre = timbre;
+    timbreMicros = micros;
+    midiOutPush(micros, 0xb0 | mpeChan, MPE_TIMBRE, timbre);
+  }
+}
+
+void mpeStop(uint32_t micros) {
+  noteOff(micros);
+  mpeOn = 0;
+}
@@ -0,0 +1,37 @@
+/*
+  ondes_mpe.h
+
+  MIDI Polyphonic Expression output, so the Ondes can play other synths
+  as an expressive controller. It goes out of the performance port (see
+  ondes_midiout.h) as an MPE lower zone: channel 1 is the master channel
+  and each note is given the next of member channels 2 - 16, so the
+  release of one note is never bent by the next. Each note carries
+  - pitch bend: the exact pitch from the note played (Ruban and vibrato),
+    over a range of MPE_BEND_RANGE semitones
+  - channel pressure: the Touche
+  - timbre (CC 74): the Feutre
+  and these are sent before its Note On, as MPE asks.
+
+  The main loop passes the whole state of the instrument to mpeFrame()
+  as often as it likes. Only the values that have changed are sent, and
+  each at most once per mpePeriod, so a fast scan doesn't flood the
+  port.
+*/
+
+#ifndef ONDES_MPE_H
+#define ONDES_MPE_H
+
+#include <stdint.h>
+
+#define MPE_MEMBERS    15 // member channels
+#define MPE_BEND_RANGE 48 // semitones either way, the MPE default
+#define MPE_TIMBRE     74 // CC for the third dimension
+
+extern uint8_t  mpeOn;
+extern uint32_t mpePeriod;  // shortest time between updates, in us
+
+void mpeStart(uint32_t);
+void mpeFrame(uint32_t, int, float, uint8_t, uint8_t, uint8_t);
+void mpeStop(uint32_t);
+
+#endif
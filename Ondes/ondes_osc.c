@@ -0,0 +1,387 @@
+/*
+  ondes_osc.c
+
+  OSC link between ondes_server (either variant) and the PD patch.
+  See ondes_osc.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <lo/lo.h>
+#include "ondes_osc.h"
+
+lo_address pd_lo;
+uint8_t    oscUnix = 0;
+
+/* Each message goes out in a bundle with '/seq <n>' ahead of it, so PD
+   can spot a lost message and ask for a /refresh. The lock keeps the
+   numbers in the order the packets are sent, since the /refresh handler
+   runs in the liblo server thread */
+static pthread_mutex_t oscLock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t  oscSeq = 0;
+static lo_bundle oscSnapshot = NULL;
+
+/* The PD process, its heartbeat and the round trip times. The pong
+   handler runs in the liblo server thread, the rest in the main loop */
+uint32_t oscWatchdogMillis = OSC_WATCHDOG_MILLIS;
+uint32_t oscRttHist[OSC_RTT_BUCKETS];
+void   (*oscResync)(void) = NULL;
+static pid_t    pdPid = 0;
+static volatile uint8_t  pdAlive = 0;
+static volatile uint32_t pongMillis;
+static uint32_t pingMillis;
+static uint32_t pingId = 0;
+static uint32_t pingMicros[16];
+static uint32_t rttMin = UINT32_MAX, rttMax = 0, rttLast = 0;
+
+/* The [qlist] file being written for an offline render, and the time
+   of its last line */
+static FILE      *oscCapture = NULL;
+static lo_timetag captureTT;
+
+/* Output policies for the continuous controls, which can be changed
+   with 'stream <path> <deadband> <min ms> <max ms>' lines in the config
+   file. A stream is only sent when a value has moved by more than the
+   deadband since it was last sent, and no more often than the minimum
+   interval. Changes in between are coalesced, so the latest value goes
+   out as soon as the interval is up. An unchanged stream is resent at
+   the maximum interval as a keep-alive, so a lost message can't leave
+   PD stuck on an old value */
+oscStream oscStreams[] = {
+  { "/anlg", 1, 0, 1000, 0 },
+  { "/vib",  0, 0, 500,  0 },
+  { NULL,    0, 0, 0,    0 }
+};
+
+lo_server_thread oscOpen(lo_err_handler err_h) {
+  /* Set up the OSC server for messages from PD on port 4001 (or on a
+     Unix socket) and the address of PD's OSC server. The caller adds
+     its methods to the returned server thread and starts it */
+  lo_server_thread st;
+  if (oscUnix) {
+    unlink(OSC_SERVER_SOCK); // remove a stale socket left by a crash
+    st = lo_server_thread_new_with_proto(OSC_SERVER_SOCK, LO_UNIX, err_h);
+    pd_lo = lo_address_new_with_proto(LO_UNIX, NULL, OSC_PD_SOCK);
+  } else {
+    st = lo_server_thread_new(OSC_SERVER_PORT, err_h);
+    pd_lo = lo_address_new(NULL, OSC_PD_PORT);
+  }
+
+  return st;
+}
+
+void oscClose(lo_server_thread st) {
+  lo_server_thread_free(st);
+  lo_address_free(pd_lo);
+  if (oscUnix) unlink(OSC_SERVER_SOCK);
+}
+
+void oscTimetagAdd(lo_timetag *tt, uint32_t micros) {
+  /* Advance an OSC timetag by a number of microseconds. The fraction
+     is in units of 2^-32 seconds */
+  uint64_t frac = (uint64_t) tt->frac +
+    (((uint64_t) (micros % 1000000) << 32) / 1000000);
+  tt->sec += micros / 1000000 + (uint32_t) (frac >> 32);
+  tt->frac = (uint32_t) frac;
+}
+
+static lo_message oscSeqMessage(void) {
+  /* Call with oscLock held */
+  lo_message msg = lo_message_new();
+  oscSeq = (oscSeq + 1) & OSC_SEQ_MASK;
+  lo_message_add_int32(msg, oscSeq);
+  return msg;
+}
+
+static void oscCaptureWrite(const lo_timetag *when, const char *path,
+			    lo_message msg) {
+  /* One [qlist] line, which hands the message to [s oscIn] just as
+     [pipelist] would have, after the delay in ms since the last line */
+  double ms = 0;
+  if (when) {
+    ms = lo_timetag_diff(*when, captureTT) * 1000.0;
+    if (ms < 0) {
+      ms = 0;
+    } else {
+      captureTT = *when;
+    }
+  }
+  const char *types = lo_message_get_types(msg);
+  lo_arg **argv = lo_message_get_argv(msg);
+  fprintf(oscCapture, "%.3f oscIn list %s", ms, path);
+  for (int i = 0; types[i]; i++) {
+    switch (types[i]) {
+    case 'i':
+      fprintf(oscCapture, " %d", argv[i]->i);
+      break;
+    case 'f':
+      fprintf(oscCapture, " %g", argv[i]->f);
+      break;
+    case 's':
+      fprintf(oscCapture, " %s", &argv[i]->s);
+      break;
+    }
+  }
+  fprintf(oscCapture, ";\n");
+}
+
+int oscSendInternal(const lo_timetag *when, const char *path,
+		    const char *types, ...) {
+  /* Use the oscSend() and oscSendAt() macros rather than calling this
+     directly - they add the end marker liblo expects after the data */
+  va_list ap;
+  int ret;
+  lo_message msg = lo_message_new();
+
+  va_start(ap, types);
+  ret = lo_message_add_varargs(msg, types, ap);
+  va_end(ap);
+  if (ret < 0) {
+    fprintf(stderr, "oscSend: bad arguments for %s\n", path);
+    lo_message_free(msg);
+    return ret;
+  }
+
+  if (oscCapture) {
+    oscCaptureWrite(when, path, msg);
+    lo_message_free(msg);
+    return 0;
+  }
+
+  /* PD's [unpackOSC] reports the time until the timetag and [pipelist]
+     holds the message until then. The sequence number is checked as
+     the bundle arrives, so a timetag doesn't look like a lost message */
+  lo_bundle bundle = lo_bundle_new(when ? *when : LO_TT_IMMEDIATE);
+  pthread_mutex_lock(&oscLock);
+  lo_bundle_add_message(bundle, "/seq", oscSeqMessage());
+  lo_bundle_add_message(bundle, path, msg);
+  ret = lo_send_bundle(pd_lo, bundle);
+  pthread_mutex_unlock(&oscLock);
+  lo_bundle_free_recursive(bundle);
+
+  return ret;
+}
+
+void oscSnapshotBegin(void) {
+  pthread_mutex_lock(&oscLock);
+  oscSnapshot = lo_bundle_new(LO_TT_IMMEDIATE);
+  /* '/snapshot <n>' replaces '/seq <n>' and tells PD to take n as the
+     current number rather than checking it for a gap */
+  lo_bundle_add_message(oscSnapshot, "/snapshot", oscSeqMessage());
+}
+
+int oscSnapshotAddInternal(const char *path, const char *types, ...) {
+  /* Use the oscSnapshotAdd() macro, as for oscSend() */
+  va_list ap;
+  int ret;
+  lo_message msg = lo_message_new();
+
+  va_start(ap, types);
+  ret = lo_message_add_varargs(msg, types, ap);
+  va_end(ap);
+  if (ret < 0) {
+    fprintf(stderr, "oscSnapshotAdd: bad arguments for %s\n", path);
+    lo_message_free(msg);
+    return ret;
+  }
+  lo_bundle_add_message(oscSnapshot, path, msg);
+
+  return 0;
+}
+
+int oscSnapshotSend(void) {
+  int ret = lo_send_bundle(pd_lo, oscSnapshot);
+  lo_bundle_free_recursive(oscSnapshot);
+  oscSnapshot = NULL;
+  pthread_mutex_unlock(&oscLock);
+
+  return ret;
+}
+
+oscStream *oscStreamFind(const char *path) {
+  for (oscStream *s = oscStreams; s->path; s++) {
+    if (0 == strcmp(s->path, path)) return s;
+  }
+  return NULL;
+}
+
+uint8_t oscStreamDue(oscStream *s, const int16_t *val, int16_t *last,
+		     uint8_t n, uint32_t nowMillis) {
+  /* Decide whether the n values in val[] should be sent now, comparing
+     them with the values last sent in last[], which are updated if so */
+  uint32_t elapsed = nowMillis - s->lastMillis;
+  uint8_t changed = 0;
+  for (uint8_t i = 0; i < n; i++) {
+    if (abs(val[i] - last[i]) > s->deadband) changed = 1;
+  }
+  if ((changed && (elapsed >= s->minMillis)) ||
+      (s->maxMillis && (elapsed >= s->maxMillis))) {
+    memcpy(last, val, n * sizeof(int16_t));
+    s->lastMillis = nowMillis;
+    return 1;
+  }
+
+  return 0;
+}
+
+static uint32_t oscMicros(void) {
+  /* Same clock as myMicros() in the servers */
+  struct timespec tm;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &tm);
+
+  return (uint32_t) tm.tv_sec * 1000000u + (uint32_t) (tm.tv_nsec / 1000);
+}
+
+void oscPdStart(void) {
+  /* Start PD directly rather than through system() so we know its pid,
+     telling the patch which transport to use */
+  pid_t pid = fork();
+  if (0 == pid) {
+    if (oscUnix) {
+      execlp("pd", "pd", "-nogui", "-send", "transport unix",
+	     OSC_PD_PATCH, (char *) NULL);
+    } else {
+      execlp("pd", "pd", "-nogui", OSC_PD_PATCH, (char *) NULL);
+    }
+    fprintf(stderr, "oscPdStart: can't run pd\n");
+    _exit(1);
+  } else if (pid < 0) {
+    fprintf(stderr, "oscPdStart: fork failed\n");
+    return;
+  }
+  pdPid = pid;
+  pdAlive = 0;
+  pongMillis = pingMillis = oscMicros() / 1000;
+}
+
+void oscPdStop(void) {
+  /* Ask PD to stop, and kill it if it hasn't gone within a second */
+  if (pdPid <= 0) return;
+  kill(pdPid, SIGTERM);
+  for (uint8_t i = 0; i < 100; i++) {
+    if (waitpid(pdPid, NULL, WNOHANG) == pdPid) {
+      pdPid = 0;
+      return;
+    }
+    usleep(10000);
+  }
+  kill(pdPid, SIGKILL);
+  waitpid(pdPid, NULL, 0);
+  pdPid = 0;
+}
+
+void oscWatchdog(void) {
+  /* Call this regularly from the main loop. It sends '/ping <id>', which
+     the patch echoes back as '/pong <id>', and restarts PD if it has
+     exited or hasn't answered in time */
+  uint32_t nowMillis = oscMicros() / 1000;
+  if ((pdPid <= 0) || ((nowMillis - pingMillis) < OSC_PING_MILLIS)) return;
+  pingMillis = nowMillis;
+
+  if (waitpid(pdPid, NULL, WNOHANG) == pdPid) {
+    fprintf(stderr, "PD has exited - restarting it\n");
+    pdPid = 0;
+    oscPdStart();
+    return;
+  }
+  if (oscWatchdogMillis &&
+      ((nowMillis - pongMillis) >
+       ((pdAlive) ? oscWatchdogMillis : OSC_PD_START_MILLIS))) {
+    fprintf(stderr, "PD has not answered for %u ms - restarting it\n",
+	    nowMillis - pongMillis);
+    oscRttReport(stderr);
+    oscPdStop();
+    oscPdStart();
+    return;
+  }
+
+  pingId = (pingId + 1) & OSC_SEQ_MASK;
+  pingMicros[pingId & 15] = oscMicros();
+  oscSend("/ping", "i", pingId);
+}
+
+int oscPongHandler(const char *path, const char *types, lo_arg **argv,
+		   int argc, void *data, void *user_data) {
+  /* Record the round trip time for a ping, unless it is too old to
+     still have its send time */
+  uint32_t id = (uint32_t) argv[0]->i & OSC_SEQ_MASK;
+  if (((pingId - id) & OSC_SEQ_MASK) < 16) {
+    uint32_t rtt = oscMicros() - pingMicros[id & 15];
+    uint8_t bucket = 0;
+    while ((bucket < OSC_RTT_BUCKETS - 1) && (rtt >> (bucket + 1))) bucket++;
+    oscRttHist[bucket]++;
+    rttLast = rtt;
+    if (rtt < rttMin) rttMin = rtt;
+    if (rtt > rttMax) rttMax = rtt;
+  }
+  pongMillis = oscMicros() / 1000;
+
+  if (!pdAlive) {
+    /* First answer since PD was (re)started - push the state to it
+       rather than waiting for the patch to ask */
+    pdAlive = 1;
+    if (oscResync) oscResync();
+  }
+
+  return 0;
+}
+
+void oscRttReport(FILE *f) {
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < OSC_RTT_BUCKETS; i++) total += oscRttHist[i];
+  if (0 == total) {
+    fprintf(f, "PD round trip: no replies\n");
+    return;
+  }
+  fprintf(f, "PD round trip (us): last %u  min %u  max %u  (%u pings)\n",
+	  rttLast, rttMin, rttMax, total);
+  for (uint8_t i = 0; i < OSC_RTT_BUCKETS; i++) {
+    if (oscRttHist[i]) {
+      fprintf(f, "  %8u - %8u  %u\n", 1u << i, (2u << i) - 1, oscRttHist[i]);
+    }
+  }
+}
+
+int oscCaptureOpen(const char *path, const lo_timetag *start) {
+  /* Write messages to a [qlist] file from now on rather than sending
+     them. Timetags are measured from start */
+  if (NULL == (oscCapture = fopen(path, "w"))) {
+    fprintf(stderr, "oscCaptureOpen: can't write %s\n", path);
+    return -1;
+  }
+  captureTT = *start;
+  return 0;
+}
+
+void oscCaptureClose(void) {
+  if (oscCapture) fclose(oscCapture);
+  oscCapture = NULL;
+}
+
+int oscPdBatch(const char *patch) {
+  /* Run a patch in a second PD with no audio device, which computes
+     the DSP as fast as it can instead of in real time, and wait for it
+     to quit. Returns PD's exit status */
+  int status;
+  pid_t pid = fork();
+  if (0 == pid) {
+    execlp("pd", "pd", "-batch", "-nogui", "-open", patch, (char *) NULL);
+    fprintf(stderr, "oscPdBatch: can't run pd\n");
+    _exit(1);
+  } else if (pid < 0) {
+    fprintf(stderr, "oscPdBatch: fork failed\n");
+    return -1;
+  }
+  if (waitpid(pid, &status, 0) != pid) return -1;
+
+  return (WIFEXITED(status)) ? WEXITSTATUS(status) : -1;
+}
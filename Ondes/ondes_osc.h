@@ -0,0 +1,92 @@
+/*
+  ondes_osc.h
+
+  OSC link between ondes_server (either variant) and the PD patch.
+  All messages to PD go through oscSend() / oscSendAt() so that the
+  transport and message framing are handled in one place.
+*/
+
+#ifndef ONDES_OSC_H
+#define ONDES_OSC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <lo/lo.h>
+
+/* UDP on localhost by default, or Unix domain datagram sockets if
+   selected with -unix on the command line or 'transport unix' in the
+   config file */
+#define OSC_PD_PORT     "4000"
+#define OSC_SERVER_PORT "4001"
+#define OSC_PD_SOCK     "/tmp/ondes_pd"
+#define OSC_SERVER_SOCK "/tmp/ondes_server"
+
+/* Every message to PD is numbered. The number wraps at 2^20 so that it
+   is still exact when PD holds it as a float */
+#define OSC_SEQ_MASK    0xfffff
+
+/* PD is pinged this often and must answer within the watchdog time
+   ('watchdog <ms>' in the config file, 0 to disable), or it is killed
+   and restarted. It is allowed longer to load the patch after starting */
+#define OSC_PING_MILLIS     500
+#define OSC_WATCHDOG_MILLIS 3000
+#define OSC_PD_START_MILLIS 20000
+#define OSC_PD_PATCH        "/home/pi/Ondes/PD/Ondes.pd"
+
+/* Round trip times are counted in power-of-two buckets of microseconds,
+   so bucket n holds times from 2^n to 2^(n+1) - 1 */
+#define OSC_RTT_BUCKETS     24
+
+/* For an offline render the messages are written to a [qlist] file
+   instead of being sent, and PD plays it in batch mode */
+#define OSC_RENDER_PATCH    "/home/pi/Ondes/PD/render.pd"
+#define OSC_RENDER_QLIST    "/tmp/ondes_render.txt"
+
+/* Output policy for a continuous control stream (see ondes_osc.c) */
+typedef struct {
+  const char *path;
+  uint16_t deadband;   // change needed before a new value is sent
+  uint16_t minMillis;  // shortest time between messages
+  uint16_t maxMillis;  // resend an unchanged value after this (0 = never)
+  uint32_t lastMillis; // time of the last message
+} oscStream;
+
+extern lo_address pd_lo;
+extern uint8_t    oscUnix;
+extern oscStream  oscStreams[];
+extern uint32_t   oscWatchdogMillis;
+extern uint32_t   oscRttHist[OSC_RTT_BUCKETS];
+extern void     (*oscResync)(void);
+
+lo_server_thread oscOpen(lo_err_handler);
+void oscClose(lo_server_thread);
+void oscTimetagAdd(lo_timetag *, uint32_t);
+int  oscSendInternal(const lo_timetag *, const char *, const char *, ...);
+void oscSnapshotBegin(void);
+int  oscSnapshotAddInternal(const char *, const char *, ...);
+int  oscSnapshotSend(void);
+oscStream *oscStreamFind(const char *);
+uint8_t oscStreamDue(oscStream *, const int16_t *, int16_t *, uint8_t, uint32_t);
+void oscPdStart(void);
+void oscPdStop(void);
+void oscWatchdog(void);
+int  oscPongHandler(const char *, const char *, lo_arg **, int, void *, void *);
+void oscRttReport(FILE *);
+int  oscCaptureOpen(const char *, const lo_timetag *);
+void oscCaptureClose(void);
+int  oscPdBatch(const char *);
+
+/* Send a message to PD immediately, or wrapped in a bundle with a
+   timetag so that PD can hold it until exactly that time */
+#define oscSend(path, types...) \
+  oscSendInternal(NULL, path, types, LO_ARGS_END)
+#define oscSendAt(when, path, types...) \
+  oscSendInternal(when, path, types, LO_ARGS_END)
+
+/* Collect the complete state for PD into one bundle, which is sent with
+   a single version number by oscSnapshotSend(). Nothing else can be sent
+   between oscSnapshotBegin() and oscSnapshotSend() */
+#define oscSnapshotAdd(path, types...) \
+  oscSnapshotAddInternal(path, types, LO_ARGS_END)
+
+#endif
@@ -15,10 +15,19 @@
     mcp3008 SPI ADC to read ribbon, touche and control pots and pedals
        via IOCTL communication on SPI0.0
 
+    Either (the original switch-matrix keyboard)
     mcp23s17 SPI port expander on SPI0.1 to scan the keyboard and switches
        via the MCP23S17 library. There are more than 64 keys + switches
        in total, so GPIO24 is used to select the final bank of switches
        (transposition) while scanning
+    or (built with -DMIDI_KEYBOARD as ondes_server_M)
+    mcp23s08 SPI port expander on SPI0.1 to scan the switches (including
+       the vibrato switch on the keyboard) via IOCTL communication
+       GPIOs 19, 20 and 21 are used to scan the banks of switches
+    and a MIDI keyboard scanned by this program. It's easier to keep track
+       of multiple key-presses here rather than in PD, and we can keep the
+       existing LIBLO messaging so the PD patch is unchanged. The interface
+       board for this has a sixth octave marker LED
 
     adxl362 SPI accelerometer on non-standard SPI0.2 for vibrato control
        via IOCTL communication
@@ -35,6 +44,12 @@
     Rotary encoder on GPIO 5 & 6, switch on GPIO 12 with connections
        defined using dtoverlay entries in /boot/config.txt
 
+    Optional USB memory stick mounted on /usbdrive with subdirectories
+       WAV and MIDI. These can be symbolically linked to /home/pi/Ondes/WAV
+       and /home/pi/Ondes/MIDI to allow data files to be transferred easily.
+       Without a USB stick use real directories instead of symbolic links and
+       transfer data to and from the remote computer by scp.
+
 
   Modified:
     17 10 19 - no longer adds an offset to the keyboard codes generated by
@@ -83,10 +98,98 @@
                the colour information to ondes_server via liblo). This program
                now launches PD after liblo has been initialised, which appears
                to have fixed the problem.
+    15 02 21 - branched as ondes_server_M.c to work with a MIDI keyboard
+               rather than a switch-matrix keyboard
     21 02 21 - tweaked the order of startup events so LEDs and LCD are
                synchronised better
-
- cc -o ~/Ondes/ondes_server ondes_server.c -llo -lm -lmcp23s17 -llcd1602 -I/usr/local/include
+    18 10 26 - optional Unix domain datagram sockets for the OSC link with
+               PD instead of UDP ports 4000/4001 (-unix on the command line
+               or 'transport unix' in the config file). PD receives through
+               the unixosc external
+    18 10 26 - MIDI playback sends each event a configurable look-ahead early
+               ('lookahead <ms>' in the config file, default 20) as an OSC
+               bundle timetagged with the time it should sound; PD holds it
+               in [pipelist] until then. Sleeps between events instead of
+               spinning. OSC sending moved to ondes_osc.c
+    18 10 26 - analogue values and vibrato are timetagged with the time the
+               scan was due plus a fixed latency ('latency <ms>' in the config
+               file, default 5) so PD plays them out at a constant latency; the
+               PD patch ramps pitch and volume per sample with [vline~]. Also
+               fixed analogueVal[] being one element too short
+    18 10 26 - per-stream output policy for /anlg and /vib (deadband, minimum
+               and maximum interval, 'stream' lines in the config file). /vib is
+               no longer sent every 5ms when the accelerometer hasn't moved
+    18 10 26 - number every OSC message and answer /refresh with one snapshot
+               bundle
+    18 10 26 - start PD with fork/exec, ping it and restart it if it stops
+               answering
+    18 10 26 - MIDI playback on its own thread, sleeping to absolute times,
+               with pause and stop from the encoder. Fixed tv_sec in delay()
+    18 10 26 - MIDI files compiled at load into a timeline with absolute times
+               (ondes_midifile.c)
+    18 10 26 - MIDI files with any number of tracks merged with a min-heap
+    18 10 26 - bounds-checked MIDI file reader with running status. Note On
+               velocity 0 treated as Note Off
+    18 10 26 - jump to a bar and loop bars during MIDI playback
+    18 10 26 - live overlay - chosen streams come from the instrument during
+               MIDI playback
+    18 10 26 - -render <file> renders a MIDI file to WAV offline through
+               pd -batch and PD/render.pd
+    18 10 26 - MIDI library (ondes_midilib.c) of the playable files in
+               ~/Ondes/MIDI and /usbdrive/MIDI, kept up to date with inotify,
+               so the file picker opens instantly and shows each file's title
+               and length. Fixed the .mid filter
+    18 10 26 - live recordings are also saved as a MIDI file (ondes_midirec.c)
+               in ~/Ondes/MIDI, written in the background when recording
+               stops. Touche played from Channel Volume (CC 7)
+    18 10 26 - MIDI Clock / MTC output, or following MIDI Clock, on a raw MIDI
+               port ('sync <port> clock mtc follow' in the config file), timed
+               from the playback clock by ondes_midisync.c
+    18 10 26 - (MIDI keyboard) MIDI keyboard read through a streaming byte
+               parser (ondes_midiin.c) whenever poll() finds it ready instead
+               of 4 bytes every 15ms, so no notes are lost. Running status and
+               all channels are handled, and Note On with velocity 0 releases
+               the key
+    18 10 26 - (MIDI keyboard) ALSA sequencer input ('keyboard <port>' in the
+               config file) through a real time queue, so every key carries
+               its kernel arrival time. Keys are timetagged at that time plus
+               the analogue latency
+    18 10 26 - (MIDI keyboard) Several MIDI keyboards at once ('keyboard
+               <name> <name>...', or 'any' for every hardware port), merged in
+               time order. Inputs are connected when plugged in (ALSA
+               announcements, or looking for a raw device every 2s), and keys
+               held on one that is unplugged are released
+    18 10 26 - selectable note priority (ondes_keys.c) - low, high, last or
+               first note, from the LCD menu or 'priority' in the config file.
+               Held keys kept as a 128-bit bitmap and in press order, so the
+               key to play is found in constant time
+    18 10 26 - (MIDI keyboard) Note velocity and channel / poly aftertouch can
+               play the Touche ('dynamics off|blend|override <curve>' in the
+               config file), through a response curve worked out once into a
+               lookup table
+    18 10 26 - 14-bit controllers (MSB / LSB pairs) and NRPNs (MSB 0x4F, LSB
+               the analogue value) for the Touche, Ruban, levels, Expression
+               and Feutre, put together by midiCtrl14() in ondes_midifile.c
+               for MIDI files and the MIDI keyboards alike
+    18 10 26 - performance mirror ('mirror [<port>]' in the config file) -
+               keys, Ruban, Touche and switches sent as they are played to an
+               ALSA sequencer port by ondes_midiout.c, through a lock-free
+               ring and a thread of its own, using the MIDI recording's
+               controllers
+    18 10 26 - MPE output ('mpe <rate>' in the config file) - ondes_mpe.c
+               plays the instrument as an MPE lower zone on the performance
+               port, each note on the next member channel with its pitch bend,
+               pressure (Touche) and timbre (Feutre, CC 74) sent before the
+               Note On and then only as they change, at most <rate> times a
+               second
+    18 10 26 - one server for both keyboards - ondes_server_M.c merged back
+               in, built with -DMIDI_KEYBOARD. The keyboard/switch backends
+               (kbdOpen, kbdScan, kbdKeys, kbdWait, kbdClose) and the LED
+               layout are chosen at compile time
+
+ cc -o ~/Ondes/ondes_server ondes_server.c ondes_osc.c ondes_midifile.c ondes_midilib.c ondes_midirec.c ondes_midisync.c ondes_keys.c ondes_midiout.c ondes_mpe.c -llo -lpthread -lm -lasound -lmcp23s17 -llcd1602 -I/usr/local/include
+ or for a MIDI keyboard
+ cc -DMIDI_KEYBOARD -o ~/Ondes/ondes_server_M ondes_server.c ondes_osc.c ondes_midifile.c ondes_midilib.c ondes_midirec.c ondes_midisync.c ondes_keys.c ondes_midiout.c ondes_mpe.c ondes_midiin.c -llo -lpthread -lm -lasound -llcd1602 -I/usr/local/include
  
 */
 
@@ -105,18 +208,93 @@
 #include <lo/lo.h>
 #include <math.h>
 #include <time.h>
+#include <pthread.h>
+#include <errno.h>
 #include <lcd1602.h>
 #include <linux/ioctl.h>
 #include <linux/input.h>
 #include <linux/spi/spidev.h>
+#ifdef MIDI_KEYBOARD
+#include <poll.h>
+#else
 #include <mcp23s17.h>
-
-/* Defines for the 74hc595 lines & the 'extra' switch bank select
+#endif
+#include "ondes_osc.h"
+#include "ondes_midifile.h"
+#include "ondes_midilib.h"
+#include "ondes_midirec.h"
+#include "ondes_midisync.h"
+#include "ondes_keys.h"
+#include "ondes_midiout.h"
+#include "ondes_mpe.h"
+#ifdef MIDI_KEYBOARD
+#include "ondes_midiin.h"
+#endif
+
+/* Defines for the 74hc595 lines & the switch bank selects
    using GPIO numbers */
 #define SER    27
 #define RCLK   22
 #define SRCLK  23
+#ifdef MIDI_KEYBOARD
+#define SW_1   19
+#define SW_2   20
+#define SW_3   21
+#else
 #define SW_SEL 24
+#endif
+
+#ifdef MIDI_KEYBOARD
+/* Defines for the MCP23S08 */
+#define IODIR   0x00  // I/O direction
+#define IPOL    0x01  // I/O polarity
+#define GPINTEN 0x02  // interrupt enable
+#define DEFVAL  0x03  // register default value (interrupts)
+#define INTCON  0x04  // interrupt control
+#define IOCON   0x05  // I/O config
+#define GPPU    0x06  // port pullups
+#define INTF    0x07  // interrupt flag (where the interrupt came from)
+#define INTCAP  0x08  // interrupt capture (value at interrupt is saved here)
+#define GPIO    0x09  // port
+#define OLATA   0x0A  // output latch
+
+/* MCP23S08 I/O config */
+#define SEQOP_OFF   0x20 // incrementing address pointer
+#define SEQOP_ON    0x00
+#define DISSLW_ON   0x10 // slew rate
+#define DISSLW_OFF  0x00
+#define HAEN_ON     0x08 // hardware addressing
+#define HAEN_OFF    0x00
+#define ODR_ON      0x04 // open drain for interupts
+#define ODR_OFF     0x00
+#define INTPOL_HIGH 0x02 // interrupt polarity
+#define INTPOL_LOW  0x00
+
+#define WRITE_CMD 0
+#define READ_CMD 1
+#endif
+
+/* The LEDs on the 74hc595s. Pairs of bits from bit 0 up are the octave
+   markers (01 or 10 red or green), with the Touche RGB LED above them.
+   The MIDI keyboard's interface board has six octave markers to the
+   switch-matrix keyboard's five */
+#ifdef MIDI_KEYBOARD
+#define LED_BITS    15     // 74hc595 outputs used
+#define LED_RGB     12     // shift for the Touche LED colour
+#define LED_OCTAVES 0x0fff // the octave markers
+#define LED_TOUCHE  0xf000 // and the rest
+#define LED_RED     0x0555 // all octave markers red
+#define OCT_MAX     12     // octave shift limits
+#define OCT_MIN     -24
+#else
+#define LED_BITS    13
+#define LED_RGB     10
+#define LED_OCTAVES 0x03ff
+#define LED_TOUCHE  0x3c00
+#define LED_RED     0x0155
+#define OCT_MAX     24
+#define OCT_MIN     -24
+#endif
 
 /* Defines for the LCD display */
 #define LCD_ADDR 0x27
@@ -154,10 +332,11 @@ uint8_t done    = 0;
 uint8_t btn_d   = 0;
 uint8_t rty_d   = 0;
 uint8_t submenu = 0;
-uint16_t analogueLast[8] = {9999, 9999, 9999, 9999, 9999, 9999, 9999, 9999};
+int16_t analogueLast[8] = {9999, 9999, 9999, 9999, 9999, 9999, 9999, 9999};
 uint8_t fsLast = 1;
 uint8_t fs     = 1;
 unsigned int analogueMillis;
+unsigned int analogueMicros;
 unsigned int keyboardMillis;
 unsigned int lcdMillis;
 unsigned int loopMillis = 0;
@@ -174,22 +353,68 @@ static const uint16_t spi_delay = 0;
 static const char *spidev[3]    = { "/dev/spidev0.0",
 				    "/dev/spidev0.1",
 				    "/dev/spidev0.2" };
-int mcp3008_fd, mcp23s17_fd, adxl632_fd;
+int mcp3008_fd, adxl632_fd;
 uint8_t colour[8] = {0, 1, 3, 2, 6, 4, 5, 7};
 uint8_t rgb_led   = 0;
 uint8_t rgb_old   = 0;
-uint16_t oct_led  = 0x0165; // binary 0101100101 => red, red, green, red, red
+uint16_t oct_led  = LED_RED ^ 0x30; // red, red, green, red, red (, red)
 uint16_t ledMask  = 0xffff;
 uint16_t recMask  = 0x0000;
+char     recName[13];     // date and time the recording started
 uint8_t shiftreg_count = 0;
 
-int16_t analogueVal[7];
-uint8_t prevKeys[9] = {0};
-int     lastKey     = 0;
+#define TOUCHE_MAX 820 // Touche values are 0 - 820
+int16_t analogueVal[8];
+int16_t toucheVal   = 0;  // the Touche itself
+uint8_t prevSws[3]  = {0};
+int     lastKey     = 60; // middle C until a key is played
+keyState heldKeys;        // keys held (as MIDI notes), in the order pressed
+uint8_t lastPlay    = 0;
 float   tuning      = 440.0;
-int     vib;
-
-lo_address pd_lo;
+int16_t vib;
+int16_t vibLast = 9999;
+oscStream *anlgStream, *vibStream;
+uint32_t anlgLatency = 5000; // play out analogue values & vibrato 5ms
+lo_timetag anlgTT;           // after they were due to be read (0 = off)
+lo_timetag *anlgWhen = NULL;
+
+/* The keyboard and switches come from one of two backends, chosen when
+   the server is built, each with the same functions (kbdOpen() etc.,
+   at the end of this file). The main loop calls them directly, so the
+   choice costs nothing while scanning */
+#ifdef MIDI_KEYBOARD
+/* MIDI keyboards, with the switches on an MCP23S08 */
+#define KBD_SCAN_MILLIS 15 // switch scan interval
+int mcp23s08_fd;
+char kbNames[MIDIIN_MAX][64] = { "/dev/snd/midiC1D0" }; // raw devices or
+uint8_t kbCount = 1;                                      // sequencer ports
+lo_timetag keyTT;
+uint64_t inputKeys[MIDIIN_MAX][2] = {{0}}; // keys held on each input
+/* Dynamics from the keyboard's velocity and aftertouch, played on the
+   Touche through a response curve ('dynamics <mode> <curve>' in the
+   config file). The curve is an exponent: 1 is linear, less than 1
+   makes soft playing louder, more than 1 quieter */
+#define DYN_OFF      0
+#define DYN_BLEND    1   // the louder of the Touche and the keyboard
+#define DYN_OVERRIDE 2   // the keyboard only
+const char *dynModes[] = { "off", "blend", "override" };
+uint8_t dynMode     = DYN_OFF;
+float   dynCurve    = 1.0;
+int16_t dynTable[128];     // velocity or pressure to Touche value
+int16_t dynVelocity = 0;   // level from the note's velocity
+int16_t dynPressure = 0;   // and from aftertouch since it started
+midiCtrlState kbCtrl[MIDIIN_MAX]; // 14-bit controllers and NRPNs from
+uint8_t kbAnlg = 0;        // the keyboards, and the analogue values they
+                           // have taken over from the hardware
+#else
+/* The switch-matrix keyboard and switches on an MCP23S17 */
+#define KBD_SCAN_MILLIS 10
+int mcp23s17_fd;
+uint8_t prevRows[6] = {0}; // keys 0 - 47 (key 48 is bit 0 of prevSws[0])
+/* The analogue values are only read from the hardware */
+static const uint8_t kbAnlg = 0;
+static inline int16_t dynTouche(void) { return toucheVal; }
+#endif
 
 float palme_freq[][2] = { 69.3,   0.02,
 			  73.42,  0.02,
@@ -269,10 +494,31 @@ void gpioSetBank1(uint32_t);
 void gpioSetBank2(uint32_t);
 int8_t gpioInitialise(void);
 
+/* keyboard and switch backend functions */
+void    kbdOpen(void);
+uint8_t kbdScan(uint8_t *);
+void    kbdKeys(uint16_t, const uint8_t *);
+void    kbdWait(void);
+void    kbdClose(void);
+#ifdef MIDI_KEYBOARD
+void    keyRelease(uint8_t);
+void    dynFillTable(void);
+int16_t dynTouche(void);
+void    keyboardEvent(const midiEvent *);
+uint8_t keyboardCtrl(const midiEvent *);
+
+/* mcp23s08 functions */
+static uint8_t get_spi_control_byte(uint8_t, uint8_t);
+void mcp23s08_write_reg(uint8_t, uint8_t, uint8_t, int);
+uint8_t mcp23s08_read_reg(uint8_t, uint8_t, int);
+#endif
+
 /* other miscellaneous functions */
 void analogueReset(void);
 uint32_t myMicros(void);
 uint32_t myMillis(void);
+uint64_t myNanos(void);
+void sleepUntil(uint64_t);
 void delay(uint32_t);
 int spi_open(int);
 int16_t read_mcp3008(uint8_t);
@@ -281,10 +527,31 @@ void srPulse(int);
 void srSend(uint16_t);
 void setOctaveLEDs(void);
 void setToucheLED(void);
-int  playMidiFile(void);
-int  readVarLen(char **);
-void parseEvent(char **);
+int  startMidiFile(void);
+int  midiLoaded(void);
+void pauseMidiFile(uint8_t);
+void stopMidiFile(void);
+void *playMidiFile(void *);
+int  renderMidiFile(const char *);
+int  waitForMidi(uint32_t, uint64_t *, uint32_t);
+uint32_t seekToBar(uint32_t, uint64_t *, uint32_t *);
+void followMidiFile(void);
+uint32_t followTo(uint32_t);
+void applySnapshot(const midiSnapshot *);
+void playRuban(int);
+int8_t  ctrlChannel(uint16_t);
+int16_t ctrlAnlg(uint8_t, uint16_t);
+void lcdTitle(void);
+void playEvent(const midiEvent *);
+void sendMidiAnlg(uint8_t, int16_t);
+void sendMidiSw(void);
+void silenceMidiNote(void);
+uint16_t liveSources(void);
 void selectMidiFile(void);
+void showMidiFile(void);
+void startMidiRecord(const char *);
+void stopMidiRecord(void);
+void sendMpe(uint32_t, uint16_t);
 
 /* Add the handlers to act on messages received from PD */
 void liblo_error(int num, const char *m, const char *path);
@@ -294,6 +561,7 @@ int generic_handler(const char *path, const char *types, lo_arg **argv,
 
 int refresh_handler(const char *path, const char *types, lo_arg ** argv,
                     int argc, void *data, void *user_data);
+void sendSnapshot(void);
 
 int led_handler(const char *path, const char *types, lo_arg ** argv,
 		int argc, void *data, void *user_data);
@@ -311,9 +579,11 @@ char    menuText[][17] = {"Tuning  A ",
 			  "Octave LED ",
 			  "Record  ",
 			  "Play MIDI No    ",
+			  "Eject USB  No   ",
 			  "Save config  No ",
 			  "Update OS  No   ",
-			  "Shutdown  No    "};
+			  "Shutdown  No    ",
+			  "Priority  "};
 char    lcdText[17];
 uint8_t lcdBacklight = 1;
 uint8_t lcdBlink     = 0;
@@ -325,32 +595,206 @@ uint8_t saveConfig   = 0;
 uint8_t recording    = 0;
 uint8_t doRecord     = 0;
 uint8_t doUpdateOS   = 0;
-
-/* Declarations for MIDI playback */
-uint8_t playMidi     = 0;
-int ticksPerQtr;
-unsigned int qtrMicros = 500000; // Set default MIDI tempo crotchet=120
-uint8_t eoTrk[2];
-int delta[2];
-uint8_t track;
+uint8_t ejectUSB     = 0;
+
+/* Declarations for MIDI playback
+   The file is played by its own thread, which sleeps until each event
+   is due. The main loop carries on running the encoder and LCD so that
+   playback can be paused or stopped, but doesn't scan the keyboard or
+   analogue controls until playback has finished */
+#define MIDI_IDLE    0
+#define MIDI_PLAYING 1
+#define MIDI_PAUSED  2
+#define MIDI_DONE    3 // finished, waiting for the main loop to tidy up
+#define MIDI_LOADING 4 // thread started, midiPiece not ready yet
+#define MIDI_POLL_NANOS 100000000ULL // check for pause/stop every 100ms
+uint8_t playMidi     = 0; // 0 No, 1 Play, 2 Select, 3 Pause, 4 Stop, 5 Bar, 6 Loop
+midiSong midiPiece;       // the file being played, with its bar index
+volatile uint32_t midiSeekBar = 0;   // bar to jump to (from 1, 0 = none)
+volatile uint32_t midiLoopA = 0;     // first and last bars of the loop
+volatile uint32_t midiLoopB = 0;     //   being played (0 = none)
+volatile uint32_t midiPosMicros = 0; // time in the piece of the last event
+uint8_t  midiBarEdit = 0; // choosing a bar to jump to
+uint32_t midiBarSel  = 1;
+
+/* Sources for the live overlay. While a MIDI file plays, the streams
+   set in liveMask ('live <stream> ...' in the config file) still come
+   from the instrument, and the file supplies the rest. Everything is
+   played from the file by default */
+#define LIVE_KEYS     0x0001 // /key
+#define LIVE_SWITCHES 0x0002 // /sw
+#define LIVE_VIBRATO  0x0004 // /vib, or pitch bend from the file in Clavier mode
+#define LIVE_ANLG(n)  (0x0100 << (n)) // /anlg channel n
+#define LIVE_ANLGS    0xff00
+#define LIVE_ALL      0xffff
+uint16_t liveMask = 0;
+const struct {
+  const char *name;
+  uint16_t mask;
+} liveStreams[] = {
+  { "keys",       LIVE_KEYS },
+  { "switches",   LIVE_SWITCHES },
+  { "vibrato",    LIVE_VIBRATO },
+  { "touche",     LIVE_ANLG(0) },
+  { "ruban",      LIVE_ANLG(1) },
+  { "levels",     LIVE_ANLG(2) | LIVE_ANLG(3) | LIVE_ANLG(4) | LIVE_ANLG(5) },
+  { "expression", LIVE_ANLG(6) },
+  { "feutre",     LIVE_ANLG(7) },
+  { NULL,         0 }
+};
+/* analogueVal[] holds the merged values, written by the main loop and
+   the playback thread */
+pthread_mutex_t anlgLock = PTHREAD_MUTEX_INITIALIZER;
+volatile uint8_t midiState = MIDI_IDLE;
+volatile uint8_t midiPauseReq = 0;
+volatile uint8_t midiStopReq  = 0;
+pthread_t midiThread;
+pthread_mutex_t midiLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  midiCond = PTHREAD_COND_INITIALIZER;
+int midiNote = 24;
+midiCtrlState fileCtrl;         // 14-bit controllers and NRPNs from the file
+uint32_t midiLookahead = 20000; // send events 20ms early (0 = immediately)
+lo_timetag midiStartTT;
+char syncPort[64] = "";         // MIDI Clock / MTC port, if any
+uint8_t syncModes = 0;          // SYNC_CLOCK, SYNC_MTC or SYNC_FOLLOW
+uint8_t mirrorOn = 0;           // mirror the performance to the sequencer
+char mirrorPort[64] = "";       // and connect it here, if anywhere
+uint16_t mpeRate = 0;           // MPE updates a second (0 = no MPE)
+lo_timetag midiTT;
+lo_timetag *midiWhen = NULL;
 int octaveOffset;
-uint8_t midiKeys[3];
+uint8_t midiSws[3];
 uint8_t claquement = 1; // Default to claquement mode for MIDI playback
 uint8_t ruban      = 0; // Default to clavier mode
-uint8_t midiCount  = 0;
 int midiSel        = 0;
-char **midiFile    = NULL;
+char midiPath[300];       // the file chosen from the library
+/* Where MIDI files are looked for. The USB stick may come and go */
+const char *const midiDirs[] = { "/home/pi/Ondes/MIDI", "/usbdrive/MIDI", NULL };
+const char *renderName = NULL; // MIDI file to render with -render
 
 int main(int argc, char *argv[]) {
   /* Check for command line arguments */
   for (uint8_t i = 1; i < argc; i++) {
     if (0 == strcasecmp(argv[i], "-debug")) debug = 1;
+    if (0 == strcasecmp(argv[i], "-unix"))  oscUnix = 1;
+    if ((0 == strcasecmp(argv[i], "-render")) && (i + 1 < argc)) {
+      renderName = argv[++i];
+    }
   }
 
-  /* Set up the OSC stuff with a new server on port 4001
-   * and add methods to handle the messages from PD */
-  lo_server_thread st = lo_server_thread_new("4001", liblo_error);
-  lo_address pd_addr  = lo_address_new(NULL, "4000");
+  /* Read the config file if it exists */
+  { FILE *cf_d;
+    char line[80];
+    char *offset;
+    int pos;
+    if ((cf_d = fopen("/home/pi/.ondesconfig", "r"))) {
+      while (fgets(line, 80, cf_d)) {
+	//fprintf(stderr, "%s", line);
+	if (0 == strncmp(line, "touche ", 7)) {
+	  offset = &line[7];
+	  toucheLED = atoi(offset);
+	  if (toucheLED > 1) toucheLED = 1;
+	  setToucheLED();
+	} else if (0 == strncmp(line, "octave ", 7)) {
+	  offset = &line[7];
+	  octaveLED = atoi(offset);
+	  if (octaveLED > 2) octaveLED = 1;
+	  setOctaveLEDs();
+	} else if (0 == strncmp(line, "tuning ", 7)) {
+	  offset = &line[7];
+	  tuning = atof(offset);
+	} else if (0 == strncmp(line, "transport ", 10)) {
+	  offset = &line[10];
+	  if (0 == strncmp(offset, "unix", 4)) oscUnix = 1;
+	} else if (0 == strncmp(line, "lookahead ", 10)) {
+	  offset = &line[10];
+	  midiLookahead = (uint32_t) atoi(offset) * 1000;
+	} else if (0 == strncmp(line, "latency ", 8)) {
+	  offset = &line[8];
+	  anlgLatency = (uint32_t) atoi(offset) * 1000;
+	} else if (0 == strncmp(line, "watchdog ", 9)) {
+	  offset = &line[9];
+	  oscWatchdogMillis = (uint32_t) atoi(offset);
+	} else if (0 == strncmp(line, "live ", 5)) {
+	  /* Streams to play live over a MIDI file */
+	  liveMask = 0;
+	  for (char *name = strtok(&line[5], " \t\n"); name;
+	       name = strtok(NULL, " \t\n")) {
+	    for (uint8_t i = 0; liveStreams[i].name; i++) {
+	      if (0 == strcmp(name, liveStreams[i].name)) {
+		liveMask |= liveStreams[i].mask;
+	      }
+	    }
+	  }
+#ifdef MIDI_KEYBOARD
+	} else if (0 == strncmp(line, "keyboard ", 9)) {
+	  /* Raw MIDI devices, and/or ALSA sequencer ports for kernel
+	     timestamps ("any" for every hardware port) */
+	  char *name = strtok(&line[9], " \t\n");
+	  for (kbCount = 0; name && (kbCount < MIDIIN_MAX);
+	       name = strtok(NULL, " \t\n")) {
+	    snprintf(kbNames[kbCount++], sizeof(kbNames[0]), "%s", name);
+	  }
+	} else if (0 == strncmp(line, "dynamics ", 9)) {
+	  /* Velocity and aftertouch to Touche */
+	  char mode[10];
+	  float curve;
+	  int n = sscanf(&line[9], "%9s %f", mode, &curve);
+	  for (uint8_t i = 0; (n >= 1) && (i < 3); i++) {
+	    if (0 == strcmp(mode, dynModes[i])) dynMode = i;
+	  }
+	  if ((2 == n) && (curve > 0.05) && (curve < 20.0)) dynCurve = curve;
+#endif
+	} else if (0 == strncmp(line, "priority ", 9)) {
+	  char name[8];
+	  int mode;
+	  if ((1 == sscanf(&line[9], "%7s", name)) &&
+	      ((mode = keysPriorityByName(name)) >= 0)) keyPriority = mode;
+	} else if ((0 == strncmp(line, "mirror", 6)) &&
+		   strchr(" \t\r\n", line[6])) {
+	  /* Performance mirror, and where to connect it */
+	  mirrorOn = 1;
+	  if (1 != sscanf(&line[6], "%63s", mirrorPort)) mirrorPort[0] = 0;
+	} else if ((0 == strncmp(line, "mpe", 3)) &&
+		   strchr(" \t\r\n", line[3])) {
+	  /* MPE output, and how often to update each note's expression */
+	  unsigned int rate;
+	  mpeRate = ((1 == sscanf(&line[3], "%u", &rate)) && rate) ?
+	    ((rate > 1000) ? 1000 : rate) : 200;
+	} else if (0 == strncmp(line, "sync ", 5)) {
+	  /* MIDI sync port and what to do with it */
+	  char *name = strtok(&line[5], " \t\n");
+	  snprintf(syncPort, sizeof(syncPort), "%s", (name) ? name : "");
+	  syncModes = 0;
+	  while ((name = strtok(NULL, " \t\n"))) {
+	    if (0 == strcmp(name, "clock")) syncModes |= SYNC_CLOCK;
+	    if (0 == strcmp(name, "mtc")) syncModes |= SYNC_MTC;
+	    if (0 == strcmp(name, "follow")) syncModes |= SYNC_FOLLOW;
+	  }
+	} else if (0 == strncmp(line, "stream ", 7)) {
+	  char path[20];
+	  unsigned int deadband, minMs, maxMs;
+	  oscStream *stream;
+	  if ((4 == sscanf(&line[7], "%19s %u %u %u", path,
+			   &deadband, &minMs, &maxMs)) &&
+	      (stream = oscStreamFind(path))) {
+	    stream->deadband  = deadband;
+	    stream->minMillis = minMs;
+	    stream->maxMillis = maxMs;
+	  }
+	}
+      }
+      fclose(cf_d);
+    }
+  }
+
+  /* Render a MIDI file to a WAV file and stop, without touching the
+     hardware or the PD already running for the instrument */
+  if (renderName) return renderMidiFile(renderName);
+
+  /* Set up the OSC stuff with a new server on port 4001 (or on a
+   * Unix socket) and add methods to handle the messages from PD */
+  lo_server_thread st = oscOpen(liblo_error);
 
   /* Method to match any path and args */
   lo_server_thread_add_method(st, NULL, NULL, generic_handler, NULL);
@@ -361,38 +805,21 @@ int main(int argc, char *argv[]) {
   /* Method for path /led with one int arg */
   lo_server_thread_add_method(st, "/led", "i", led_handler, NULL);
 
-  lo_server_thread_start(st);
+  /* Method for PD's answer to the watchdog's /ping */
+  lo_server_thread_add_method(st, "/pong", "i", oscPongHandler, NULL);
 
-  /* Create an address for communication with PD's OSC server */
-  pd_lo = lo_address_new(NULL, "4000");
+  lo_server_thread_start(st);
 
   /* Set up the hardware interfaces */
   /* The MCP3008 connection is on SPI0.0 */
   mcp3008_fd = spi_open(0);
   
-  /* Set up the mcp23s17 on SPI0.1 and configure its ports */
-  mcp23s17_fd = mcp23s17_open(0, 1);
-  const uint8_t ioconfig = BANK_OFF |       \
-                           INT_MIRROR_OFF | \
-                           SEQOP_OFF |      \
-                           DISSLW_OFF |     \
-                           HAEN_ON |        \
-                           ODR_OFF |        \
-                           INTPOL_LOW;
-  mcp23s17_write_reg(ioconfig, IOCON, 0, mcp23s17_fd);
-  mcp23s17_write_reg(0x00, IODIRA, 0, mcp23s17_fd); // PORT A ALL OUTPUT
-  mcp23s17_write_reg(0xff, GPIOA,  0, mcp23s17_fd); // PORT A ALL HIGH
-  mcp23s17_write_reg(0xff, IODIRB, 0, mcp23s17_fd); // PORT B ALL INPUT
-  mcp23s17_write_reg(0xff, GPPUB,  0, mcp23s17_fd); // PORT B PULLUPS
-
-  /* Initialise tiny_gpio, set GPIO22, 23, 24 & 27 as outputs
+  /* Initialise tiny_gpio, set GPIO22, 23 & 27 as outputs
      and initialise the octave and touche LEDs*/
   gpioInitialise();
-  gpioSetMode(SW_SEL, PI_OUTPUT);
   gpioSetMode(SER, PI_OUTPUT);
   gpioSetMode(RCLK, PI_OUTPUT);
   gpioSetMode(SRCLK, PI_OUTPUT);
-  gpioWrite(SW_SEL, 1);
   gpioWrite(SER, 0);
   gpioWrite(RCLK, 0);
   gpioWrite(SRCLK, 0);
@@ -404,39 +831,32 @@ int main(int argc, char *argv[]) {
   delay(1);
   adxl362(0x0A, 0x2D, 0x02); // ADXL362 enable measurement
   
-  /* Start the PD process */
-  system("pd -nogui /home/pi/Ondes/PD/Ondes.pd &");
+  /* Set up the keyboard and switches */
+  keysClear(&heldKeys);
+  kbdOpen();
+
+  /* Start the PD process. The watchdog restarts it if it stops answering
+     pings, and the state is pushed to it as soon as it answers */
+  oscResync = sendSnapshot;
+  oscPdStart();
+
+  /* Find the MIDI files, and watch for any more */
+  midiLibOpen(midiDirs);
+
+  /* Lead or follow other MIDI devices */
+  if (syncPort[0]) midiSyncOpen(syncPort, syncModes);
+  if (mpeRate && (0 == midiOutOpen(mirrorPort))) {
+    /* MPE takes the port over from the mirror */
+    mpePeriod = 1000000 / mpeRate;
+    mpeStart(myMicros());
+  } else if (mirrorOn && (0 == midiOutOpen(mirrorPort))) {
+    midiRecMirror = midiOutPush;
+    midiRecReset();
+  }
 
   /* Set up the rotary encoder */
   getEncoderDescriptors();
 
-  /* Read the config file if it exists */
-  { FILE *cf_d;
-    char line[80];
-    char *offset;
-    int pos;
-    if ((cf_d = fopen("/home/pi/.ondesconfig", "r"))) {
-      while (fgets(line, 80, cf_d)) {
-	//fprintf(stderr, "%s", line);
-	if (0 == strncmp(line, "touche ", 7)) {
-	  offset = &line[7];
-	  toucheLED = atoi(offset);
-	  if (toucheLED > 1) toucheLED = 1;
-	  setToucheLED();
-	} else if (0 == strncmp(line, "octave ", 7)) {
-	  offset = &line[7];
-	  octaveLED = atoi(offset);
-	  if (octaveLED > 2) octaveLED = 1;
-	  setOctaveLEDs();
-	} else if (0 == strncmp(line, "tuning ", 7)) {
-	  offset = &line[7];
-	  tuning = atof(offset);
-	}
-      }
-      fclose(cf_d);
-    }
-  }
-
   /* Set up the LCD display */
   lcd1602Init(1, LCD_ADDR);
   lcd1602Control(1, 0, 0); // backlight, nocursor, noblink
@@ -451,6 +871,10 @@ int main(int argc, char *argv[]) {
 
   analogueReset();
   analogueMillis = myMillis();
+  analogueMicros = myMicros();
+  anlgStream = oscStreamFind("/anlg");
+  vibStream  = oscStreamFind("/vib");
+  anlgWhen = (anlgLatency) ? &anlgTT : NULL;
   keyboardMillis = analogueMillis;
   loopMillis     = analogueMillis;
   lcdMillis      = analogueMillis;
@@ -469,192 +893,187 @@ int main(int argc, char *argv[]) {
        7 - Feutre pedal cutoff
      */
     ++loopcount;
+    /* Which streams to read from the instrument - all of them unless a
+       MIDI file is playing */
+    uint16_t live = liveSources();
     /* Analogue values */
-    if ((myMillis() - analogueMillis) >= 5) {
-      uint8_t changed = 0;
+    if ((live & (LIVE_ANLGS | LIVE_VIBRATO)) &&
+	((myMillis() - analogueMillis) >= 5)) {
+      /* Timestamp this scan with the time it was due rather than the time
+	 it actually ran, plus a fixed latency. PD holds the messages until
+	 then, so the Touche, Ruban and vibrato are played out on a regular
+	 5ms grid whatever the scan or delivery jitter */
+      if (anlgLatency) {
+	int late = (int) (myMicros() - analogueMicros);
+	lo_timetag_now(&anlgTT);
+	if (late < (int) anlgLatency) {
+	  oscTimetagAdd(&anlgTT, anlgLatency - late);
+	}
+      }
+      /* Channels played from a MIDI file keep the file's values */
+      /* and so do those played from a MIDI controller */
+      pthread_mutex_lock(&anlgLock);
       for (uint8_t i = 0; i < 8; i++) {
-	analogueVal[i] = read_mcp3008(i);
+	if ((live & LIVE_ANLG(i)) && !(kbAnlg & (1 << i))) {
+	  analogueVal[i] = read_mcp3008(i);
+	}
       }
       /* Set the range for the Touche control (do it here to
 	 avoid sending unnecessary UDP messages) */
-      if (analogueVal[0] > 920) analogueVal[0] = 920;
-      if (analogueVal[0] < 100) analogueVal[0] = 100;
-      analogueVal[0] = 920 - analogueVal[0];
-      for (uint8_t i = 0; i < 8; i++) {
-	/* Filter noise in the lowest bits from the A/D conversion
-	   '> 0' in the line below means no filter */
-	if (abs(analogueVal[i] - analogueLast[i]) > 1) {
-	  analogueLast[i] = analogueVal[i];
-	  changed = 1;
-	}
+      if ((live & LIVE_ANLG(0)) && !(kbAnlg & 1)) {
+	if (analogueVal[0] > 920) analogueVal[0] = 920;
+	if (analogueVal[0] < 100) analogueVal[0] = 100;
+	toucheVal = 920 - analogueVal[0];
       }
-      if (changed) {
-	lo_send(pd_lo, "/anlg", "iiiiiiii",
-		analogueVal[0], analogueVal[1], analogueVal[2],
-		analogueVal[3], analogueVal[4], analogueVal[5],
-		analogueVal[6], analogueVal[7]);
+      if (live & LIVE_ANLG(0)) analogueVal[0] = dynTouche();
+      /* The stream's deadband filters noise in the lowest bits from the
+	 A/D conversion, and its intervals limit the message rate */
+      if (oscStreamDue(anlgStream, analogueVal, analogueLast, 8,
+		       analogueMillis)) {
+	oscSendAt(anlgWhen, "/anlg", "iiiiiiii",
+		  analogueVal[0], analogueVal[1], analogueVal[2],
+		  analogueVal[3], analogueVal[4], analogueVal[5],
+		  analogueVal[6], analogueVal[7]);
+	midiRecAnlg(analogueMicros, analogueVal, octaveShift);
       }
+      pthread_mutex_unlock(&anlgLock);
 
       /* Read the accelerometer 8-bit X-axis for vibrato */
       vib = adxl362(0x0B, 0x08, 0x00);
-      lo_send(pd_lo, "/vib", "i", vib);
+      if ((live & LIVE_VIBRATO) &&
+	  oscStreamDue(vibStream, &vib, &vibLast, 1, analogueMillis)) {
+	oscSendAt(anlgWhen, "/vib", "i", vib);
+	midiRecVib(analogueMicros, vib);
+      }
+      sendMpe(analogueMicros, live);
 
       analogueMillis += 5;
+      analogueMicros += 5000;
     }
 
-    /* Scan the keyboard and switch array
-       Keys are in the range 0 - 48, switches are 49 - 63 on the
-       MCP32S17 plus 64 - 71 addressed via GPIO24 */
-    if ((myMillis() - keyboardMillis) >= 15) { // was 10
-      uint8_t mask = 1;
-      uint8_t keys[9] = {0};
-      uint8_t changed = 0;
-      for (uint8_t i = 0; i < 8; i++) {
-	/* set the 'i'th bit of Port A to 0 for the keyboard / switch
-	   scan (starting at the right-hand end) */
-	mcp23s17_write_reg((uint8_t) ~mask, GPIOA, 0, mcp23s17_fd);
-	mask <<= 1;
-	keys[i] = (uint8_t) mcp23s17_read_reg(GPIOB, 0, mcp23s17_fd);
-	/* Invert so pressed keys are 1, others 0. Do it this way so
-	 * that we only have one bit to shift in the keymask (below) */
-	keys[i] = ~keys[i];
-	
-	if (keys[i] != prevKeys[i]) {
-	  changed = 1;
-	  prevKeys[i] = keys[i];
-	}
-      }
-      /* Set all pins high on MCP23S17 port A, set SW_SEL (GPIO24) low
-	 and read the final bank of switches */
-      mcp23s17_write_reg(255, GPIOA, 0, mcp23s17_fd);
-      gpioWrite(SW_SEL, 0);
-      keys[8] = (uint8_t) mcp23s17_read_reg(GPIOB, 0, mcp23s17_fd);
-      gpioWrite(SW_SEL, 1);
-      keys[8] = ~keys[8];
-      if (keys[8] != prevKeys[8]) {
-	changed = 1;
-	prevKeys[8] = keys[8];
-      }
-
-      if (changed) {
+    /* Scan the switches (and the switch-matrix keyboard with them) */
+    if ((live & (LIVE_KEYS | LIVE_SWITCHES)) &&
+	((myMillis() - keyboardMillis) >= 15)) { // was 10
+      uint8_t switches[3];
+      if (kbdScan(switches)) {
 	/* The key presses and/or switch settings have changed.
-	   Send the the status of all the switches and the
-           lowest pressed keyboard key */
-	if (debug) fprintf(stderr,
-	    "Keys: %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x\n",
-	    keys[8], keys[7], keys[6], keys[5], keys[4], keys[3], keys[2],
-	    keys[1], keys[0]);
-	changed = 0;
-
-	/* Send the switches first.
-	   Bit 1 of keys[6] is the keyboard mounted vibrato switch.
-           Bit 2 is the 'T' switch - turn on all voices except Souffle
-	   (keys[7] bit 1) if this is set.
-	   Bits 3 - 7 are Ondes, Creux, Gambe, Nasillard & Octaviant
-
-	   keys[7] bits:
-	   Bits 0 - 1 are petit Gambe & Souffle
-	   Bit 2 is Clavier / Ruban selection
-	   Bit 3 is legato / claquement keyboard mode
-	   Bits 4 - 7 are the D1 - D4 selectors
-
-	   keys[8] bits 0 - 5 are the transposition buttons
-	   Bits 6 & 7 are the octave shifters */
-	if (keys[6] & 4) {
+	   Send the the status of all the switches, then the keys.
+	   switches[0] bits:
+	   0   - top note of the switch-matrix keyboard (N/C otherwise)
+	   1   - keyboard mounted vibrato switch.
+           2   - 'T' switch - turn on all voices except Souffle
+	                      (switches[1] bit 1) if this is set
+	   3-7 - Ondes, Creux, Gambe, Nasillard & Octaviant
+
+	   switches[1] bits:
+	   0-1 - petit Gambe & Souffle
+	   2   - Clavier / Ruban selection
+	   3   - legato / claquement keyboard mode
+	   4-7 - D1 - D4 selectors
+
+	   switches[2] bits:
+	   0-5 - transposition buttons
+	   6-7 - octave shifters */
+	if (switches[0] & 4) {
 	  /* turn on voices if 'T' is on */
-	  keys[6] |= 248; // Ondes, Creux, Gambe, Nasillard, Octaviant
-	  keys[7] |= 1;   // petit Gambe
+	  switches[0] |= 248; // Ondes, Creux, Gambe, Nasillard, Octaviant
+	  switches[1] |= 1;   // petit Gambe
 	}
-	/* Bit 0 of keys[6] is the top note of the keyboard, and
-	   bits 6 & 7 of keys[8] are the octave shifters
+	/* Bit 0 of switches[0] is the top note of the keyboard, and
+	   bits 6 & 7 of switches[2] are the octave shifters
 	   - mask these when sending switch data to PD */
-	lo_send(pd_lo, "/sw", "iii", keys[6] & 254, keys[7], keys[8] & 63);
+	if (live & LIVE_SWITCHES) {
+	  oscSend("/sw", "iii", switches[0] & 254, switches[1],
+		  switches[2] & 63);
+	  midiRecSw(myMicros(), switches[0] & 254, switches[1]);
+	}
 
 	/* Check the octave shift buttons */
-	if (keys[8] & 64) {
+	if (switches[2] & 64) {
 	  /* Octave down pressed */
 	  if (!octDnPressed) {
 	    /* It wasn't pressed last pass, so update and send the octave */
-	    if (octaveShift > -24) octaveShift -= 12;
+	    if (octaveShift > OCT_MIN) octaveShift -= 12;
 	    octDnPressed = 1;
-	    lo_send(pd_lo, "/oct", "i", octaveShift);
+	    oscSend("/oct", "i", octaveShift);
 	    if (debug) fprintf(stderr, "Octave shift down %d\n", octaveShift);
 	    /* Change the octave marker LEDs by flipping the pair of bits
 	       corresponding to the selected octave.
-	       Note: 0x0155 is binary 0101010101 - 5 red LEDs */
-	    oct_led = 0x0155 ^ (3 << 4 + (octaveShift / 6));
-	    srSend(((colour[rgb_led] << 10) | oct_led) & ledMask);
+	       Note: LED_RED is binary 0101010101 - 5 red LEDs (or 6) */
+	    oct_led = LED_RED ^ (3 << 4 + (octaveShift / 6));
+	    srSend(((colour[rgb_led] << LED_RGB) | oct_led) & ledMask);
 	    shiftreg_count = 0;
 	  }
 	} else {
 	  octDnPressed = 0;
 	}
-	if (keys[8] & 128) {
+	if (switches[2] & 128) {
 	  /* Octave up pressed */
 	  if (!octUpPressed) {
 	    /* It wasn't pressed last pass, so update and send the octave */
-	    if (octaveShift < 24) octaveShift += 12;
+	    if (octaveShift < OCT_MAX) octaveShift += 12;
 	    octUpPressed = 1;
-	    lo_send(pd_lo, "/oct", "i", octaveShift);
+	    oscSend("/oct", "i", octaveShift);
 	    if (debug) fprintf(stderr, "Octave shift up %d\n", octaveShift);
 	    /* Change the octave marker LEDs by flipping the pair of bits
 	       corresponding to the selected octave.
-	       Note: 0x0155 is binary 0101010101 - all LEDs red */
-	    oct_led = 0x0155 ^ (3 << 4 + (octaveShift / 6));
-	    srSend(((colour[rgb_led] << 10) | oct_led) & ledMask);
+	       Note: LED_RED is binary 0101010101 - all LEDs red */
+	    oct_led = LED_RED ^ (3 << 4 + (octaveShift / 6));
+	    srSend(((colour[rgb_led] << LED_RGB) | oct_led) & ledMask);
 	    shiftreg_count = 0;
 	  }
 	} else {
 	  octUpPressed = 0;
 	}
 
-	/* The Ondes has low-note priority, so scan UP the keyboard
-	   If we find a pressed key send its code and stop scanning
-	   In legato mode send nothing if no keys are pressed,
-	   in claquement mode send 'play 0' message when the
-	   last key is released */
-	uint8_t scanning = 1;
-	for (uint8_t i = 0; (i < 6) && scanning; i++) {
-	  uint8_t keyMask = 1;
-	  for (uint8_t j = 0; (j < 8) && scanning; j++) {
-	    /* look at the state of each key in turn */
-	    //fprintf(stderr, "I: %u  K: %d  M: %d \n", i, keys[i], keyMask);
-	    if ((keys[i] & keyMask)) {
-	      /* This key is pressed so send its code and stop scanning */
-	      lastKey = i*8 + j;
-	      lo_send(pd_lo, "/key", "ii", lastKey, 1);
-	      scanning = 0;
-	    }
-	    /* Shift the bit mask for the next pass */
-	    keyMask <<= 1;
-	  }
-	}
-	/* Finally check the top note if no other is pressed */
-	if (scanning) {
-	  if (keys[6] & 1) {
-	    lastKey = 48;
-	    lo_send(pd_lo, "/key", "ii", lastKey, 1);
-	  } else if (keys[7] & 8) {
-	    /* 'Interrupted mode' on keyboard */
-	    lo_send(pd_lo, "/key", "ii", lastKey, 0);
-	  } else {
-	    /* 'Legato mode' */
-	    lo_send(pd_lo, "/key", "ii", lastKey, 1);
-	  }
-	}
-	  //}
-
-      } /* end of 'if (changed)' */
-    
-      keyboardMillis += 10;
+	/* Play the keys of the switch-matrix keyboard. MIDI keyboards
+	   are played as their notes arrive */
+	kbdKeys(live, switches);
+      }
+      keyboardMillis += KBD_SCAN_MILLIS;
     }
     ++ shiftreg_count;
     if (50 == shiftreg_count) {
       /* refresh the shift registers 'just in case' */
-      srSend(((colour[rgb_led] << 10) | oct_led) & ledMask);
+      srSend(((colour[rgb_led] << LED_RGB) | oct_led) & ledMask);
       shiftreg_count = 0;
     }
-    usleep(1000);
+    if (MIDI_DONE == midiState) {
+      /* MIDI playback has finished or been stopped, so tidy up and go
+	 back to reading the hardware. Force the Tiroir settings to be
+	 resent and restart the scan timers from now */
+      pthread_join(midiThread, NULL);
+      midiFree(&midiPiece);
+      midiState = MIDI_IDLE;
+      playMidi = 0;
+      midiBarEdit = 0;
+      midiSeekBar = 0;
+      midiLoopA = midiLoopB = 0;
+      prevSws[2] ^= 0xff;
+      analogueMillis = myMillis();
+      analogueMicros = myMicros();
+      keyboardMillis = analogueMillis;
+      if (4 == menuItem) {
+	menuActive = 0;
+	lcd1602Control(lcdBacklight, 0, menuActive);
+	lcd1602SetCursor(10, 1);
+	lcd1602WriteString("Done  ");
+      }
+      /* Stop recording if active at the end of MIDI playback */
+      if (recording) {
+	oscSend("/record", "s", "stop");
+	stopMidiRecord();
+	recording = 0;
+	doRecord = 0;
+	recMask = 0x0000;
+      }
+      lcdTitle();
+      lcdMillis = myMillis();
+    }
+
+    oscWatchdog();
+    midiLibPoll();
+    kbdWait();
 
     /* Check for and process rotary encoder activity */
     if (encoderPress()) {
@@ -670,7 +1089,8 @@ int main(int argc, char *argv[]) {
 	menuActive = 1;
 	switch (menuItem) {
 	case 0: // Tuning
-	case 7: // Shutdown
+	case 8: // Shutdown
+	case 9: // Note priority
 	  lcd1602SetCursor(9, 1);
 	  break;
 	case 1: // Touche LED
@@ -685,10 +1105,13 @@ int main(int argc, char *argv[]) {
 	case 4: // Select / play MIDI file
 	  lcd1602SetCursor(9, 1);
 	  break;
-	case 5: // Save config
+	case 5: // Eject USB drive
+	  lcd1602SetCursor(10, 1);
+	  break;
+	case 6: // Save config
 	  lcd1602SetCursor(12, 1);
 	  break;
-	case 6: // Update OS
+	case 7: // Update OS
 	  lcd1602SetCursor(10, 1);
 	  break;
 	}
@@ -714,7 +1137,9 @@ int main(int argc, char *argv[]) {
 	    doRecord = 0;
 	    if (recording) {
 	      //fprintf(stderr, "Was recording, now stopped\n");
-	      lo_send(pd_lo, "/record", "s", "stop");
+	      oscSend("/record", "s", "stop");
+	      stopMidiRecord();
+	      midiSyncStop();
 	      lcd1602WriteString("Ondes  Framboise");
 	      lcd1602SetCursor(8, 1);
 	      lcd1602WriteString("No      ");
@@ -727,7 +1152,7 @@ int main(int argc, char *argv[]) {
 	      lcd1602WriteString("Stop    ");
 	      recording = 1;
 	      doRecord = 1;
-	      recMask = 0x03ff;
+	      recMask = LED_OCTAVES;
 	      char wavName[13];
 	      time_t t = time(NULL);
 	      struct tm *tm = localtime(&t);
@@ -735,40 +1160,130 @@ int main(int argc, char *argv[]) {
 		      tm->tm_year - 100, tm->tm_mon + 1, tm->tm_mday,
 		      tm->tm_hour, tm->tm_min, tm->tm_sec);
 	      //fprintf(stderr, "%s\n", wavName);
-	      lo_send(pd_lo, "/record", "s", wavName);
+	      oscSend("/record", "s", wavName);
+	      if (MIDI_IDLE == midiState) {
+		/* Time code runs from the start of the take */
+		startMidiRecord(wavName);
+		midiSyncPlay(myNanos(), 0, 0, NULL);
+	      }
 	    }
 	  }
 	  break;
-	case 4: // Select or play MIDI file
+	case 4: // Select, play, pause or stop MIDI file
 	  if (1 == playMidi) {
-	    /* Play the selected MIDI file */
-	    lcd1602SetCursor(10, 1);
-	    lcd1602WriteString(" >>>");
+	    /* Start playing the selected MIDI file. The main loop tidies
+	       up when the playback thread has finished */
 	    lcd1602SetCursor(10, 1);
-	    playMidiFile();
-	    lcd1602WriteString("Done");
-	    playMidi = 0;
-	    /* Stop recording if active at the end of MIDI playback */
-	    if (recording) {
-	      lo_send(pd_lo, "/record", "s", "stop");
-	      recording = 0;
-	      doRecord = 0;
-	      lcd1602SetCursor(0, 0);
-	      lcd1602WriteString("Ondes  Framboise");
-	      recMask = 0x0000;
+	    if (startMidiFile()) {
+	      lcd1602WriteString("Fail  ");
+	      playMidi = 0;
+	    } else {
+	      lcd1602WriteString(" >>>  ");
+	      playMidi = 3;
 	    }
 	  } else if (2 == playMidi) {
 	    /* Select a MIDI file */
 	    selectMidiFile();
+	  } else if ((3 == playMidi) && (MIDI_IDLE != midiState)) {
+	    pauseMidiFile(!midiPauseReq);
+	    lcd1602SetCursor(10, 1);
+	    lcd1602WriteString((midiPauseReq) ? " ||   " : " >>>  ");
+	  } else if ((4 == playMidi) && (MIDI_IDLE != midiState)) {
+	    stopMidiFile();
+	  } else if ((5 == playMidi) && midiLoaded()) {
+	    /* The first press starts choosing a bar with the encoder, the
+	       second jumps to it */
+	    if (midiBarEdit) {
+	      midiSeekBar = midiBarSel;
+	      midiBarEdit = 0;
+	      lcdTitle();
+	      lcd1602SetCursor(10, 1);
+	      lcd1602WriteString("Bar   ");
+	    } else {
+	      midiBarEdit = 1;
+	      midiBarSel = midiBarAt(&midiPiece, midiPosMicros) + 1;
+	      menuActive = 1;
+	      lcd1602Control(lcdBacklight, 0, menuActive);
+	      lcd1602SetCursor(0, 0);
+	      snprintf(lcdText, sizeof(lcdText), "Go to bar %-6u", midiBarSel);
+	      lcd1602WriteString(lcdText);
+	    }
+	    lcd1602SetCursor(9, 1);
+	  } else if ((6 == playMidi) && midiLoaded()) {
+	    /* Presses set the start and end bars of a loop from the bar
+	       being played, then cancel it */
+	    uint32_t bar = midiBarAt(&midiPiece, midiPosMicros) + 1;
+	    if (midiLoopB) {
+	      midiLoopA = midiLoopB = 0;
+	    } else if (midiLoopA) {
+	      if (bar < midiLoopA) {
+		midiLoopB = midiLoopA;
+		midiLoopA = bar;
+	      } else {
+		midiLoopB = bar;
+	      }
+	    } else {
+	      midiLoopA = bar;
+	    }
+	    lcdTitle();
+	    lcd1602SetCursor(10, 1);
+	    lcd1602WriteString((midiLoopB) ? "NoLoop" :
+			       (midiLoopA) ? "Loop B" : "Loop A");
+	    lcd1602SetCursor(9, 1);
 	  }
 	  break;
-	case 5: // Save config
+	case 5: // Eject USB
+	  if (ejectUSB) {
+	    lcd1602SetCursor(11, 1);
+	    lcd1602WriteString(">>>>");
+	    system("sudo umount /usbdrive");
+	    lcd1602SetCursor(11, 1);
+	    lcd1602WriteString("Done");
+	    ejectUSB = 0;
+	    lcdMillis = myMillis();
+	  }
+	  break;
+	case 6: // Save config
 	  if (saveConfig) {
 	    FILE *cf_d;
 	    int fail = 1;
 	    if ((cf_d = fopen("/home/pi/.ondesconfig", "w"))) {
 	      fprintf(cf_d, "tuning %5.1f\ntouche %1.1d\noctave %1.1d\n",
 		      tuning, toucheLED, octaveLED);
+	      fprintf(cf_d, "transport %s\nlookahead %u\nlatency %u\n",
+		      (oscUnix) ? "unix" : "udp", midiLookahead / 1000,
+		      anlgLatency / 1000);
+	      fprintf(cf_d, "watchdog %u\n", oscWatchdogMillis);
+	      fprintf(cf_d, "priority %s\n", keyPriorityNames[keyPriority]);
+#ifdef MIDI_KEYBOARD
+	      fprintf(cf_d, "dynamics %s %.2f\n", dynModes[dynMode], dynCurve);
+#endif
+	      fprintf(cf_d, "live");
+	      for (uint8_t i = 0; liveStreams[i].name; i++) {
+		if (liveStreams[i].mask == (liveMask & liveStreams[i].mask)) {
+		  fprintf(cf_d, " %s", liveStreams[i].name);
+		}
+	      }
+	      fprintf(cf_d, "\n");
+#ifdef MIDI_KEYBOARD
+	      fprintf(cf_d, "keyboard");
+	      for (uint8_t i = 0; i < kbCount; i++) {
+		fprintf(cf_d, " %s", kbNames[i]);
+	      }
+	      fprintf(cf_d, "\n");
+#endif
+	      if (syncPort[0]) {
+		fprintf(cf_d, "sync %s%s%s%s\n", syncPort,
+			(syncModes & SYNC_CLOCK) ? " clock" : "",
+			(syncModes & SYNC_MTC) ? " mtc" : "",
+			(syncModes & SYNC_FOLLOW) ? " follow" : "");
+	      }
+	      if (mirrorOn) fprintf(cf_d, "mirror %s\n", mirrorPort);
+	      if (mpeRate) fprintf(cf_d, "mpe %u\n", mpeRate);
+	      for (oscStream *s = oscStreams; s->path; s++) {
+		fprintf(cf_d, "stream %s %u %u %u\n", s->path,
+			s->deadband, s->minMillis, s->maxMillis);
+	      }
 	      fail = fclose(cf_d);
 	    }
 	    lcd1602SetCursor(13, 1);
@@ -776,7 +1291,7 @@ int main(int argc, char *argv[]) {
 	    saveConfig = 0;
 	  }
 	  break;
-	case 6: // Update OS
+	case 7: // Update OS
 	  if (doUpdateOS) {
 	    lcd1602SetCursor(11, 1);
 	    lcd1602WriteString(">>>>");
@@ -787,7 +1302,7 @@ int main(int argc, char *argv[]) {
 	    lcdMillis = myMillis();
 	  }
 	  break;
-	case 7: // Shutdown
+	case 8: // Shutdown
 	  if (1 == doShutdown) {
 	    lcd1602SetCursor(0, 1);
 	    lcd1602WriteString("  Restarting!   ");
@@ -797,6 +1312,9 @@ int main(int argc, char *argv[]) {
 	    lcd1602WriteString(" Shutting down! ");
 	    done = 1;
 	  }
+	  break;
+	case 9: // Note priority
+	  break;
 	}
       }
     }
@@ -818,7 +1336,7 @@ int main(int argc, char *argv[]) {
 	  sprintf(lcdText, "%5.1f ", tuning);
 	  lcd1602WriteString(lcdText);
 	  lcd1602SetCursor(9, 1);
-	  lo_send(pd_lo, "/tuning", "f", tuning);
+	  oscSend("/tuning", "f", tuning);
 	  break;
 	case 1: // touche LED
 	  toucheLED = !toucheLED;
@@ -858,6 +1376,46 @@ int main(int argc, char *argv[]) {
 	  lcd1602SetCursor(7, 1);
 	  break;
 	case 4: // Play MIDI file
+	  if (midiBarEdit) {
+	    /* Choosing a bar to jump to - show its rehearsal mark if any */
+	    int32_t bar = (int32_t) midiBarSel + clicks;
+	    if (bar < 1) bar = 1;
+	    if (bar > (int32_t) midiPiece.barCount) bar = midiPiece.barCount;
+	    midiBarSel = bar;
+	    int16_t mark = midiPiece.bars[bar - 1].marker;
+	    lcd1602SetCursor(0, 0);
+	    if (mark >= 0) {
+	      snprintf(lcdText, sizeof(lcdText), "Bar %-4u%-8.8s", midiBarSel,
+		       midiPiece.markers[mark].name);
+	    } else {
+	      snprintf(lcdText, sizeof(lcdText), "Go to bar %-6u", midiBarSel);
+	    }
+	    lcd1602WriteString(lcdText);
+	    lcd1602SetCursor(9, 1);
+	    break;
+	  } else if (MIDI_IDLE != midiState) {
+	    /* A file is playing so choose between pause/resume, stop,
+	       jumping to a bar and looping */
+	    playMidi = 3 + (playMidi + 1 + clicks / abs(clicks)) % 4;
+	    lcd1602SetCursor(10, 1);
+	    switch (playMidi) {
+	    case 3:
+	      lcd1602WriteString((midiPauseReq) ? "Resume" : "Pause ");
+	      break;
+	    case 4:
+	      lcd1602WriteString("Stop  ");
+	      break;
+	    case 5:
+	      lcd1602WriteString("Bar   ");
+	      break;
+	    case 6:
+	      lcd1602WriteString((midiLoopB) ? "NoLoop" :
+				 (midiLoopA) ? "Loop B" : "Loop A");
+	      break;
+	    }
+	    lcd1602SetCursor(9, 1);
+	    break;
+	  }
 	  playMidi += 3 + clicks / abs(clicks);
 	  playMidi %= 3;
 	  if (!midiSel && (1 == playMidi)) playMidi += clicks / abs(clicks);
@@ -876,19 +1434,25 @@ int main(int argc, char *argv[]) {
 	  }
 	  lcd1602SetCursor(9, 1);
 	  break;
-	case 5: // Save config
+	case 5: // Eject USB
+	  ejectUSB = !ejectUSB;
+	  lcd1602SetCursor(11, 1);
+	  lcd1602WriteString((ejectUSB) ? "Yes " : "No  ");
+	  lcd1602SetCursor(10, 1);
+	  break;
+	case 6: // Save config
 	  saveConfig = !saveConfig;
 	  lcd1602SetCursor(13, 1);
 	  lcd1602WriteString((saveConfig) ? "Yes" : "No ");
 	  lcd1602SetCursor(12, 1);
 	  break;
-	case 6: // Update OS
+	case 7: // Update OS
 	  doUpdateOS = !doUpdateOS;
 	  lcd1602SetCursor(11, 1);
 	  lcd1602WriteString((doUpdateOS) ? "Yes " : "No  ");
 	  lcd1602SetCursor(10, 1);
 	  break;
-	case 7: // Shutdown
+	case 8: // Shutdown
 	  doShutdown += 3 + clicks / abs(clicks);
 	  doShutdown %= 3;
 	  lcd1602SetCursor(10, 1);
@@ -905,6 +1469,14 @@ int main(int argc, char *argv[]) {
 	  }
 	  lcd1602SetCursor(9, 1);
 	  break;
+	case 9: // Note priority - takes effect straight away
+	  keyPriority += KEYS_MODES + clicks / abs(clicks);
+	  keyPriority %= KEYS_MODES;
+	  lcd1602SetCursor(10, 1);
+	  sprintf(lcdText, "%-6s", keyPriorityNames[keyPriority]);
+	  lcd1602WriteString(lcdText);
+	  lcd1602SetCursor(9, 1);
+	  break;
 	}
 
       } else {
@@ -943,11 +1515,23 @@ int main(int argc, char *argv[]) {
 	  lcd1602WriteString(menuText[menuItem]);
 	  lcd1602WriteString((recording)?"Stop    ":"No      ");
 	  break;
-	case 4: // Play MIDI file	  
-	case 5: // Save config
-	case 6: // Update OS
-	case 7: // Shutdown
+	case 4: // Play MIDI file
 	  lcd1602WriteString(menuText[menuItem]);
+	  if (MIDI_IDLE != midiState) {
+	    lcd1602SetCursor(10, 1);
+	    lcd1602WriteString((midiPauseReq) ? " ||   " : " >>>  ");
+	  }
+	  break;
+	case 5: // Eject USB
+	case 6: // Save config
+	case 7: // Update OS
+	case 8: // Shutdown
+	  lcd1602WriteString(menuText[menuItem]);
+	  break;
+	case 9: // Note priority
+	  sprintf(lcdText, "%s%-6s", menuText[menuItem],
+		  keyPriorityNames[keyPriority]);
+	  lcd1602WriteString(lcdText);
 	  break;
 	}
 	lcd1602Control(lcdBacklight, 0, menuActive);
@@ -964,17 +1548,33 @@ int main(int argc, char *argv[]) {
   /* Shutdown - send a quit message to PD, set the 'outer' octave LEDs
      to off, middle C and Touche red, close OSC, then shut down
      the Raspberry Pi */
-  lo_send(pd_lo, "/quitpd", "i", 1);
+  if (MIDI_IDLE != midiState) {
+    stopMidiFile();
+    pthread_join(midiThread, NULL);
+  }
+  stopMidiRecord(); // written while PD quits
+  oscSend("/quitpd", "i", 1);
   delay(1000);
-  lo_server_thread_free(st);
+  if (debug) oscRttReport(stderr);
+  kbdClose();
+  oscClose(st);
+  midiLibClose();
+  midiSyncClose();
+  midiRecMirror = NULL;
+  mpeStop(myMicros());
+  midiOutClose();
+  if (debug && mirrorOn) {
+    fprintf(stderr, "MIDI mirror: %u messages, %u dropped, up to %uus late\n",
+	    midiOutSent, midiOutDropped, midiOutLate);
+  }
   lcd1602SetCursor(0, 1);
   if (1 == doShutdown) {
     /* Set touche and middle C marker green */
-    srSend(0x0820); // was 0x1C10
+    srSend((2 << LED_RGB) | 0x20); // was 0x1C10
     system("sudo shutdown -r now");
   } else {
     /* Set touche and middle C marker red */
-    srSend(0x0410); // was 0x1C10
+    srSend((1 << LED_RGB) | 0x10); // was 0x1C10
     system("sudo shutdown -h now");
   }
   
@@ -1010,23 +1610,32 @@ int generic_handler(const char *path, const char *types, lo_arg **argv,
 
 int refresh_handler(const char *path, const char *types, lo_arg **argv,
                  int argc, void *data, void *user_data) {
-  lo_send(pd_lo, "/tuning", "f", tuning);
-  lo_send(pd_lo, "/key", "ii", 24, 0); // Set middle C as active note
-  lo_send(pd_lo, "/anlg", "iiiiiiii",
-	  analogueVal[0], analogueVal[1], analogueVal[2],
-	  analogueVal[3], analogueVal[4], analogueVal[5],
-	  analogueVal[6], analogueVal[7]);
-  lo_send(pd_lo, "/vib", "i", vib);
-  lo_send(pd_lo, "/oct", "i", octaveShift);
-  lo_send(pd_lo, "/sw", "iii", prevKeys[6] & 254, prevKeys[7], prevKeys[8] & 63);
+  sendSnapshot();
 
   return 0;
 }
 
+void sendSnapshot(void) {
+  /* Send the whole state in one bundle. PD takes its version number
+     as the current sequence number, so any live message sent before it
+     is superseded and any sent after it follows on without a gap */
+  oscSnapshotBegin();
+  oscSnapshotAdd("/tuning", "f", tuning);
+  oscSnapshotAdd("/key", "ii", lastKey - 36, lastPlay);
+  oscSnapshotAdd("/anlg", "iiiiiiii",
+		 analogueVal[0], analogueVal[1], analogueVal[2],
+		 analogueVal[3], analogueVal[4], analogueVal[5],
+		 analogueVal[6], analogueVal[7]);
+  oscSnapshotAdd("/vib", "i", vib);
+  oscSnapshotAdd("/oct", "i", octaveShift);
+  oscSnapshotAdd("/sw", "iii", prevSws[0] & 254, prevSws[1], prevSws[2] & 63);
+  oscSnapshotSend();
+}
+
 int led_handler(const char *path, const char *types, lo_arg **argv,
                  int argc, void *data, void *user_data) {
   rgb_led = argv[0]->i;
-  srSend(((colour[rgb_led] << 10) | oct_led) & ledMask);
+  srSend(((colour[rgb_led] << LED_RGB) | oct_led) & ledMask);
   shiftreg_count = 0;
   //fprintf(stderr, "LED colour %d\n", rgb_led);
 
@@ -1055,10 +1664,28 @@ uint32_t myMicros(void) {
   return (uint32_t) ((uint64_t)((tm.tv_nsec + 500) / 1000) + (uint64_t)tm.tv_sec * (uint64_t)1.0e6);
 }
 
+uint64_t myNanos(void) {
+  /* CLOCK_MONOTONIC rather than _RAW, because it is the clock that
+     clock_nanosleep() can sleep against */
+  struct timespec tm;
+  clock_gettime(CLOCK_MONOTONIC, &tm);
+
+  return (uint64_t) tm.tv_sec * 1000000000ULL + tm.tv_nsec;
+}
+
+void sleepUntil(uint64_t nanos) {
+  /* Sleep until an absolute myNanos() time, so that time spent before
+     the call doesn't add up into drift */
+  struct timespec tm;
+  tm.tv_sec  = (time_t) (nanos / 1000000000ULL);
+  tm.tv_nsec = (long) (nanos % 1000000000ULL);
+  while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tm, NULL));
+}
+
 void delay(unsigned int millis) {
   // Wait for specified number of milliseconds 
   struct timespec sleep;
-  sleep.tv_sec - (time_t) (millis / 1000);
+  sleep.tv_sec = (time_t) (millis / 1000);
   sleep.tv_nsec = (uint64_t) (millis % 1000) * 1000000;
   nanosleep(&sleep, NULL);
 }
@@ -1151,14 +1778,14 @@ void srPulse(int pin) {
 }
 
 void srSend(uint16_t data) {
-  /* We don't need to use the final 3 bits of the 2nd 74hc595.
-     For all 16 bits mask would start at 0x8000 and the loop limit
-     would be 16 rather than 13
+  /* We don't need to use the final bits of the 2nd 74hc595 (3 of them,
+     or 1 with six octave LEDs). For all 16 bits mask would start at
+     0x8000 and the loop limit would be 16 rather than LED_BITS
      N.B. the bits are inverted when written out to the 74HC595s,
      so an 'on' bit in the input data corresponds to an 'on' LED */
-  uint16_t mask = 0x1000;
+  uint16_t mask = 1 << (LED_BITS - 1);
   data ^= recMask; // inverts the Octave LED colours when recording
-  for (uint8_t i = 0; i < 13; i++) {
+  for (uint8_t i = 0; i < LED_BITS; i++) {
     //digitalWrite(SER, ((data & mask) == 0));
     gpioWrite(SER, ((data & mask) == 0));
     srPulse(SRCLK);
@@ -1218,34 +1845,69 @@ int8_t encoderRotate(void) {
 void setOctaveLEDs(void) {
   switch (octaveLED) {
   case 0: // Off
-    ledMask &= 0x3c00;
+    ledMask &= LED_TOUCHE;
     break;
   case 1: // All
-    ledMask |= 0x03ff;
+    ledMask |= LED_OCTAVES;
     break;
   case 2: // middle C
-    ledMask |= 0x03ff; 
-    ledMask &= 0x3eaa;
+    ledMask |= LED_OCTAVES; 
+    ledMask &= LED_TOUCHE | (0xaaaa & LED_OCTAVES);
     break;
   case 3: // middle C, only when shifted
-    ledMask |= 0x03ff; 
-    ledMask &= 0x3e8a;
+    ledMask |= LED_OCTAVES; 
+    ledMask &= LED_TOUCHE | (0xaa8a & LED_OCTAVES);
     break;
   }
 }
 
 void setToucheLED(void) {
   if (toucheLED) {
-    ledMask |= 0x3c00;
+    ledMask |= LED_TOUCHE;
   } else {
-    ledMask &= 0x03ff;
+    ledMask &= LED_OCTAVES;
+  }
+}
+
+int startMidiFile(void) {
+  /* Start the playback thread for the selected MIDI file */
+  midiPauseReq = 0;
+  midiStopReq  = 0;
+  midiState = MIDI_LOADING;
+  if (pthread_create(&midiThread, NULL, playMidiFile, NULL)) {
+    fprintf(stderr, "Failed to start the MIDI playback thread\n");
+    midiState = MIDI_IDLE;
+    return -1;
   }
+
+  return 0;
+}
+
+int midiLoaded(void) {
+  /* Whether midiPiece (and its bar index) is there to be read. The
+     playback thread only publishes MIDI_PLAYING once it has loaded it */
+  uint8_t state = __atomic_load_n(&midiState, __ATOMIC_ACQUIRE);
+  return (MIDI_PLAYING == state) || (MIDI_PAUSED == state);
 }
 
-int playMidiFile(void) {
-  /* Subroutine to play a stored MIDI file. Takes over control from the
-     main loop and passes messages to Pure Data based on values from
-     the MIDI file rather than by reading the ADC and port expander.
+void pauseMidiFile(uint8_t pause) {
+  pthread_mutex_lock(&midiLock);
+  midiPauseReq = pause;
+  pthread_cond_signal(&midiCond);
+  pthread_mutex_unlock(&midiLock);
+}
+
+void stopMidiFile(void) {
+  pthread_mutex_lock(&midiLock);
+  midiStopReq = 1;
+  pthread_cond_signal(&midiCond);
+  pthread_mutex_unlock(&midiLock);
+}
+
+void *playMidiFile(void *arg) {
+  /* Thread to play a stored MIDI file, started by startMidiFile(). It
+     passes messages to Pure Data based on values from the MIDI file
+     rather than by reading the ADC and port expander.
 
      Voices selected by Program Change events, with individual bits
      corresponding to the different voices of the Ondes:
@@ -1275,333 +1937,524 @@ int playMidiFile(void) {
      message in claquement mode.
 
      GPC 8 (83; 0x53) for analogue Feutre value */
+  (void) arg;
 
-  
-  /* Open the MIDI file memory mapped so we can do pointer operations */
-  char *trk_p[2], *tmp_p;
-  uint8_t format, numTrks;
-  int trkLen[2] = { 0, 0 };
-  struct stat sb;
-
-  qtrMicros = 500000; // Set default MIDI tempo crotchet=120
-  eoTrk[0] = 0;
-  eoTrk[1] = 0;
-  delta[0] = 0;
-  delta[1] = 0;
-  midiKeys[0] = prevKeys[6]; // Initialise with the current Tiroir settings
-  midiKeys[1] = prevKeys[7];
-  midiKeys[2] = prevKeys[8];
-
-  char tmpName[60];
-  sprintf(tmpName, "/home/pi/Ondes/MIDI/%s", midiFile[midiSel]);
-  int midi_d = open(tmpName, O_RDONLY);
-  fstat(midi_d, &sb);
-  char *midi_p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, midi_d, 0);
-
-  /* Read the MThd info */
-  tmp_p = memmem(midi_p, 200, "MThd", 4);
-  if (NULL == tmp_p) {
-    fprintf(stderr, "Failed to find MThd record\n");
-    return -1;
+  /* Compile the file into a timeline of events before starting */
+  midiSws[0] = prevSws[0]; // Initialise with the current Tiroir settings
+  midiSws[1] = prevSws[1];
+  midiSws[2] = prevSws[2];
+
+  midiNote = lastKey - 36;
+
+  if (midiLoad(midiPath, &midiPiece)) {
+    midiState = MIDI_DONE;
+    return NULL;
+  }
+  /* Only now can the main loop look at the bars */
+  __atomic_store_n(&midiState, MIDI_PLAYING, __ATOMIC_RELEASE);
+  //fprintf(stderr, "Format: %d   Tracks: %d   Ticks/Qtr: %d  Events: %u  Bars: %u\n", midiPiece.format, midiPiece.tracks, midiPiece.ticksPerQtr, midiPiece.count, midiPiece.barCount);
+
+  octaveOffset = 36 + octaveShift;
+  /* Events are sent midiLookahead microseconds before they are due, each
+     stamped with an OSC timetag for the time it should sound. PD holds
+     them until then, so the timing no longer depends on how quickly the
+     messages get through or where they land in PD's DSP blocks */
+  lo_timetag_now(&midiStartTT);
+  oscTimetagAdd(&midiStartTT, midiLookahead);
+  midiWhen = (midiLookahead) ? &midiTT : NULL;
+  /* Walk along the events, sleeping until each is due to be sent. A jump
+     to another bar (or back to the start of a loop) restarts the clock
+     from the bar line, so startNanos and midiStartTT are the real time
+     of baseMicros in the piece */
+  uint64_t startNanos = myNanos();
+  uint32_t baseMicros = 0;
+  uint32_t i = 0;
+  midiPosMicros = 0;
+  if (midiSyncMode & SYNC_FOLLOW) {
+    followMidiFile();
+  } else {
+    midiSyncPlay(startNanos + midiLookahead * 1000ULL, 0, 0, &midiPiece);
   }
-  tmp_p += 9;
-  format = tmp_p[0];
-  numTrks = tmp_p[2];
-  ticksPerQtr = tmp_p[3] << 8;
-  ticksPerQtr |= tmp_p[4];
-
-  /* Find the tracks and their lengths (which may not be needed) */
-  trk_p[0] =  midi_p;
-  for (track = 0; track < 2; track++) {
-    tmp_p = trk_p[0];
-    trk_p[track] = memmem(tmp_p, sb.st_size - 20, "MTrk", 4);
-    if (NULL == trk_p[track]) {
-      fprintf(stderr, "Failed to find MTrk record for track %d\n", track);
-      return -1;
+  while (!midiStopReq && !(midiSyncMode & SYNC_FOLLOW)) {
+    uint32_t dueMicros, loopEnd = 0;
+    uint8_t atLoopEnd = 0;
+    if (midiSeekBar) {
+      i = seekToBar(midiSeekBar - 1, &startNanos, &baseMicros);
+      midiSeekBar = 0;
+    }
+    if (midiLoopB) {
+      loopEnd = (midiLoopB < midiPiece.barCount) ?
+	midiPiece.bars[midiLoopB].micros : midiPiece.micros + 1;
+    }
+    if (i < midiPiece.count) {
+      dueMicros = midiPiece.events[i].micros;
+    } else if (loopEnd) {
+      dueMicros = loopEnd;
+    } else {
+      break;
     }
-    trk_p[track] += 4;
-    for (uint8_t i = 0; i < 4; i++) {
-      trkLen[track] <<= 8;
-      trkLen[track] |= trk_p[track][0];
-      ++trk_p[track]; 
+    if (loopEnd && (dueMicros >= loopEnd)) {
+      dueMicros = loopEnd;
+      atLoopEnd = 1;
     }
-    /* Read the first delta time for each track leaving the pointers
-       pointing to the first events */
-    delta[track] = readVarLen(&trk_p[track]);
+    if (waitForMidi(dueMicros, &startNanos, baseMicros)) break;
+    if (midiSeekBar) continue;
+    if (atLoopEnd) {
+      i = seekToBar(midiLoopA - 1, &startNanos, &baseMicros);
+      continue;
+    }
+    const midiEvent *ev = &midiPiece.events[i++];
+    midiTT = midiStartTT;
+    oscTimetagAdd(&midiTT, ev->micros - baseMicros);
+    midiPosMicros = ev->micros;
+    playEvent(ev);
   }
 
-  //fprintf(stderr, "Format: %d   Tracks: %d   Ticks/Qtr: %d  Trk1Len: %d  Trk2Len: %d\n", format, numTrks, ticksPerQtr, trkLen[0], trkLen[1]);
+  midiSyncStop();
+  if (debug) midiSyncReport(stderr);
 
-  octaveOffset = 36 + octaveShift;
-  /* Loop over all the events in the MIDI data */
-  unsigned int nextEventMicros = myMicros();
-  unsigned int lastEventMicros = nextEventMicros;
-  int diffMicros;
-  int nextEventTicks = (delta[0] < delta[1]) ? delta[0] : delta[1];
-  lastEventMicros = nextEventMicros;
-  //nextEventMicros += (nextEventTicks * qtrMicros / ticksPerQtr);
-  /* Calculate the next event time floating point so some of the
-     rounding errors will cancel */
-  nextEventMicros += (int) (((float) (nextEventTicks * qtrMicros) /
-			     (float) ticksPerQtr) + 0.5 );
-  diffMicros = nextEventMicros - lastEventMicros;
-  while (!eoTrk[0] || !eoTrk[1]) {
-    for (track = 0; track < 2; track++) {
-      //fprintf(stderr, "Track: %d\n", track);
-      while ((delta[track] <= 0) && !eoTrk[track]) {
-	parseEvent(&trk_p[track]);
-	delta[track] = readVarLen(&trk_p[track]);
+  /* Silence the last note if playback was stopped part way through */
+  if (midiStopReq) silenceMidiNote();
+
+  midiState = MIDI_DONE;
+  return NULL;
+}
+
+int waitForMidi(uint32_t dueMicros, uint64_t *startNanos, uint32_t baseMicros) {
+  /* Sleep until an event is due. PD does the fine timing so there's no
+     need to spin. The sleep is to an absolute time, in steps of no more
+     than MIDI_POLL_NANOS so that a long rest can still be paused, stopped
+     or jumped out of. Returns 1 if playback has been stopped */
+  uint64_t dueNanos;
+  while (!midiStopReq) {
+    if (midiPauseReq) {
+      /* Silence the note and wait to be resumed or stopped, then move
+	 the start of the piece on by the length of the pause */
+      uint64_t pausedNanos = myNanos();
+      uint32_t pausedMicros = baseMicros;
+      if (pausedNanos > *startNanos) {
+	pausedMicros += (uint32_t) ((pausedNanos - *startNanos) / 1000);
       }
-    }
-    if (eoTrk[0] && eoTrk[1]) break;
-    /* Calculate the time to the next midi event from the number of ticks
-       and wait until that time */
-    nextEventTicks = (delta[0] < delta[1]) ? delta[0] : delta[1];
-    //fprintf(stderr, "Micros: %lu, Incr: %lu\n", nextEventMicros, nextEventTicks * qtrMicros / ticksPerQtr);
-    lastEventMicros = nextEventMicros;
-    nextEventMicros +=  (nextEventTicks * qtrMicros / ticksPerQtr);
-    diffMicros = nextEventMicros - lastEventMicros;
-    //fprintf(stderr, "Next: %lu, Micros: %lu, Delta[0] %d, Delta[1] %d\n", nextEventMicros, micros(), delta[0], delta[1]);
-    while ((myMicros() - lastEventMicros) < diffMicros) {  }
-    delta[0] -= nextEventTicks;
-    delta[1] -= nextEventTicks;
-    //fprintf(stderr, "D0: %d,  D1: %d\n", delta[0], delta[1]);
-  }
-
-  munmap(midi_p, sb.st_size);
-  close(midi_d);
-  prevKeys[8] ^= 0xff;
-  lcdMillis = myMillis();
-}
-
-int readVarLen(char **ptr) {
-  /* Parses variable length values in MIDI data pointed to by the pointer
-     argument and updates the pointer to the byte after the variable value */
-  int data = 0;
-  while (*ptr[0] & 0x80) {
-    //fprintf(stderr, "%2.2X ", *ptr[0]);
-    data |= *ptr[0] & 0x7f;
-    ++*ptr;
-    data <<= 7;
-  }
-  //fprintf(stderr, "%2.2X ", *ptr[0]);
-  data |= *ptr[0];
-  ++*ptr;
-  //fprintf(stderr, "Data value: %d\n", data);
-  return data;
-}
-
-void parseEvent(char **ptr) {
-  /* parses and acts on the MIDI event pointed to by the argument
-     and updates the pointer to the next event */
-  //fprintf(stderr, "Delta: %d  Event %2.2X  ", delta[track], **ptr);
-  if (0xff == **ptr) {
-    /* META events */
-    ++*ptr;
-    //fprintf(stderr, "Meta event: FF %2.2X  ", **ptr);
-    if (0x2f == **ptr) {
-      /* End of track */
-      eoTrk[track] = 1;
-      ++*ptr;
-      readVarLen(ptr); // to update the pointer to the next event
-      //fprintf(stderr, "\n");
-
-    } else if (0x51 == **ptr) {
-      /* Set tempo (microseconds per crotchet)
-	 Always 3 bytes so skip over length data */
-      *ptr += 2;
-      qtrMicros = 0;
-      for (uint8_t i = 0; i < 3; i++) {
-	qtrMicros <<= 8;
-	qtrMicros |= **ptr;
-	++*ptr;
+      midiSyncStop();
+      midiState = MIDI_PAUSED;
+      silenceMidiNote();
+      pthread_mutex_lock(&midiLock);
+      while (midiPauseReq && !midiStopReq) {
+	pthread_cond_wait(&midiCond, &midiLock);
       }
-      //fprintf(stderr, "Tick length: %d\n", qtrMicros);
-    } else {
-      /* We don't need to worry about other meta events, so skip over them */
-      ++*ptr;
-      int len = readVarLen(ptr);
-      *ptr += len;
-      //fprintf(stderr, "\n");
+      pthread_mutex_unlock(&midiLock);
+      pausedNanos = myNanos() - pausedNanos;
+      *startNanos += pausedNanos;
+      oscTimetagAdd(&midiStartTT, (uint32_t) (pausedNanos / 1000));
+      midiSyncPlay(*startNanos + midiLookahead * 1000ULL, baseMicros,
+		   pausedMicros, &midiPiece);
+      midiState = MIDI_PLAYING;
+      continue;
     }
-    
-  /* Other MIDI events from here onwards*/
-  } else if (0xE0 == (**ptr & 0xf0)) {
+    if (midiSeekBar) return 0;
+    dueNanos = *startNanos + (uint64_t) (dueMicros - baseMicros) * 1000;
+    uint64_t nowNanos = myNanos();
+    if (nowNanos >= dueNanos) return 0;
+    sleepUntil((dueNanos - nowNanos > MIDI_POLL_NANOS) ?
+	       nowNanos + MIDI_POLL_NANOS : dueNanos);
+  }
+  return 1;
+}
+
+uint32_t seekToBar(uint32_t bar, uint64_t *startNanos, uint32_t *baseMicros) {
+  /* Jump to the start of a bar (counted from 0) using the index built
+     when the file was loaded. The clock restarts so that the bar line is
+     now, and the controller state at the bar line is sent so that the
+     registration is right. Returns the first event to play */
+  if (bar >= midiPiece.barCount) bar = midiPiece.barCount - 1;
+  const midiBar *b = &midiPiece.bars[bar];
+  silenceMidiNote();
+  *startNanos = myNanos();
+  *baseMicros = b->micros;
+  lo_timetag_now(&midiStartTT);
+  oscTimetagAdd(&midiStartTT, midiLookahead);
+  midiTT = midiStartTT;
+  midiSyncPlay(*startNanos + midiLookahead * 1000ULL, b->micros, b->micros,
+	       &midiPiece);
+  applySnapshot(&b->state);
+  midiPosMicros = b->micros;
+
+  return b->event;
+}
+
+void followMidiFile(void) {
+  /* Play the timeline to the MIDI Clock coming in on the sync port rather
+     than our own clock. Each event is sent as soon as the clock reaches
+     its tick, so there is no look-ahead. The sequencer in charge starts,
+     stops and moves playback; jumping or looping from the menu does
+     nothing, and pausing just mutes the notes */
+  uint32_t i = 0, pos;
+  uint8_t muted = 0;
+  midiWhen = NULL;
+  midiSyncPlay(0, 0, 0, &midiPiece); // start from wherever the master is
+  while (!midiStopReq && (i < midiPiece.count)) {
+    const midiEvent *ev = &midiPiece.events[i];
+    if (midiPauseReq != muted) {
+      muted = midiPauseReq;
+      midiState = (muted) ? MIDI_PAUSED : MIDI_PLAYING;
+      if (muted) silenceMidiNote();
+    }
+    switch (midiSyncWait(ev->tick, midiPiece.ticksPerQtr, &pos,
+			 MIDI_POLL_NANOS / 1000)) {
+    case SYNC_DUE:
+      i++;
+      midiPosMicros = ev->micros;
+      if (!muted || (0x90 != (ev->status & 0xf0))) playEvent(ev);
+      break;
+    case SYNC_MOVED:
+      i = followTo(pos);
+      break;
+    case SYNC_STOPPED:
+      silenceMidiNote();
+      break;
+    }
+  }
+}
+
+uint32_t followTo(uint32_t tick) {
+  /* Go to a tick for the master's Start or Song Position Pointer: the
+     state at the bar line, then any changes between there and the tick
+     except new notes. Returns the first event to play */
+  uint32_t bar = 0, i;
+  while ((bar + 1 < midiPiece.barCount) &&
+	 (midiPiece.bars[bar + 1].tick <= tick)) bar++;
+  silenceMidiNote();
+  applySnapshot(&midiPiece.bars[bar].state);
+  for (i = midiPiece.bars[bar].event;
+       (i < midiPiece.count) && (midiPiece.events[i].tick < tick); i++) {
+    if (0x90 != (midiPiece.events[i].status & 0xf0)) {
+      playEvent(&midiPiece.events[i]);
+    }
+  }
+  midiPosMicros = midiPiece.bars[bar].micros;
+
+  return i;
+}
+
+void applySnapshot(const midiSnapshot *state) {
+  /* Play the state left by the events before a bar line as though those
+     events had just happened. The Clavier/Ruban and Legato/Claquement
+     controllers go first as they change how the rest are sent */
+  midiEvent ev = { 0 };
+  ev.status = 0xb0;
+  midiCtrlReset(&fileCtrl);
+  for (int16_t i = -2; i < 128; i++) {
+    ev.data1 = (i < 0) ? 0x53 + i : i; // 0x51, 0x52, then all of them
+    if ((i >= 0) && ((0x51 == i) || (0x52 == i))) continue;
+    /* Data Entry and parameter numbers only make sense in order */
+    if ((6 == ev.data1) || (38 == ev.data1) ||
+	((ev.data1 >= 96) && (ev.data1 <= 101))) continue;
+    if (MIDI_UNSET == state->cc[ev.data1]) continue;
+    ev.data2 = state->cc[ev.data1];
+    playEvent(&ev);
+  }
+  for (uint8_t i = 0; i < 8; i++) {
+    /* The Ondes NRPNs */
+    const uint8_t nrpn[4][2] = { { 99, MIDI_NRPN_ONDES }, { 98, i },
+				 { 6, state->nrpn[i] >> 7 },
+				 { 38, state->nrpn[i] & 0x7f } };
+    if (MIDI_UNSET14 == state->nrpn[i]) continue;
+    for (uint8_t j = 0; j < 4; j++) {
+      ev.data1 = nrpn[j][0];
+      ev.data2 = nrpn[j][1];
+      playEvent(&ev);
+    }
+  }
+  if (MIDI_UNSET != state->program) {
+    ev.status = 0xc0;
+    ev.data1 = state->program;
+    ev.data2 = 0;
+    playEvent(&ev);
+  }
+  if (MIDI_UNSET != state->bendMsb) {
+    ev.status = 0xe0;
+    ev.data1 = state->bendLsb;
+    ev.data2 = state->bendMsb;
+    playEvent(&ev);
+  }
+  if (MIDI_UNSET != state->note) {
+    ev.status = 0x90;
+    ev.data1 = state->note;
+    ev.data2 = 64;
+    playEvent(&ev);
+  }
+}
+
+int renderMidiFile(const char *name) {
+  /* Render a MIDI file offline. The timeline is written out as the
+     messages playback would send, in a [qlist] file which a second PD
+     plays in batch mode with no audio device. That runs the DSP as fast
+     as the CPU allows rather than in real time, and the patch records
+     the 4 channels to /home/pi/Ondes/wav as usual */
+  char path[300];
+  char wavName[40];
+  const char *base = strrchr(name, '/');
+  base = (base) ? base + 1 : name;
+  if (strchr(name, '/')) {
+    snprintf(path, sizeof(path), "%s", name);
+  } else {
+    /* From the first of the MIDI directories that has it */
+    for (const char *const *dir = midiDirs; *dir; dir++) {
+      snprintf(path, sizeof(path), "%s/%s", *dir, name);
+      if (0 == access(path, R_OK)) break;
+    }
+  }
+  if (midiLoad(path, &midiPiece)) return 1;
+  lo_timetag_now(&midiStartTT);
+  if (oscCaptureOpen(OSC_RENDER_QLIST, &midiStartTT)) {
+    midiFree(&midiPiece);
+    return 1;
+  }
+
+  /* Start from the instrument at rest, as for playback with nobody at
+     the keyboard, and record to a file named after the MIDI file */
+  snprintf(wavName, sizeof(wavName), "%.*s", (int) strcspn(base, "."), base);
+  oscSend("/tuning", "f", tuning);
+  oscSend("/oct", "i", octaveShift);
+  oscSend("/sw", "iii", midiSws[0], midiSws[1], midiSws[2]);
+  oscSend("/anlg", "iiiiiiii",
+	  analogueVal[0], analogueVal[1], analogueVal[2],
+	  analogueVal[3], analogueVal[4], analogueVal[5],
+	  analogueVal[6], analogueVal[7]);
+  oscSend("/record", "s", wavName);
+
+  liveMask = 0;
+  octaveOffset = 36 + octaveShift;
+  midiNote = lastKey - 36;
+  midiWhen = &midiTT;
+  for (uint32_t i = 0; i < midiPiece.count; i++) {
+    midiTT = midiStartTT;
+    oscTimetagAdd(&midiTT, midiPiece.events[i].micros);
+    playEvent(&midiPiece.events[i]);
+  }
+  /* Silence the last note and let it die away before stopping the
+     recording and PD */
+  midiTT = midiStartTT;
+  oscTimetagAdd(&midiTT, midiPiece.micros);
+  oscSendAt(&midiTT, "/key", "ii", midiNote, 0);
+  oscTimetagAdd(&midiTT, 2000000);
+  oscSendAt(&midiTT, "/record", "s", "stop");
+  oscTimetagAdd(&midiTT, 100000);
+  oscSendAt(&midiTT, "/quitpd", "i", 1);
+  oscCaptureClose();
+
+  fprintf(stderr, "Rendering %s (%.1fs) to /home/pi/Ondes/wav/ondes%s.wav\n",
+	  path, midiPiece.micros / 1.0e6, wavName);
+  uint64_t startNanos = myNanos();
+  int ret = oscPdBatch(OSC_RENDER_PATCH);
+  double secs = (myNanos() - startNanos) / 1.0e9;
+  fprintf(stderr, "%s in %.1fs (%.1f x real time)\n",
+	  (ret) ? "Failed" : "Done", secs,
+	  (secs > 0) ? midiPiece.micros / 1.0e6 / secs : 0.0);
+  midiFree(&midiPiece);
+
+  return ret;
+}
+
+void playEvent(const midiEvent *ev) {
+  /* Acts on a MIDI channel message from the compiled timeline */
+  if (0xE0 == (ev->status & 0xf0)) {
     /* Pitch Wheel Change (2 bytes - lsb, msb) */
-    int pitch = (*(*ptr + 2) & 0x7f);
+    int pitch = ev->data2;
     pitch <<= 7;
-    pitch |= (*(*ptr + 1) & 0x7f);
+    pitch |= ev->data1;
     //fprintf(stderr, "Pitch Change: 0x%4.4X\n", pitch);
-    /* Ruban mode so send data as /midiRbn
-       Absolute pitch with 8192 equivalent to middle C (midi 60)
-       Allow for PD adding the octave offset to this value) */
     if (ruban) {
-      lo_send(pd_lo, "/midiRbn", "f", (float) pitch / 170.6666667 - 24.0 - (float) octaveShift);
-    } else {
+      /* The Ruban, unless it is being played live */
+      if (!(liveMask & LIVE_ANLG(1))) playRuban(pitch);
+    } else if (!(liveMask & LIVE_VIBRATO)) {
       /* Clavier mode so send vibrato - 8192 is 0 offset
 	 Need to calibrate this to give a sensible range;
 	 it's divided by 25 in PD - and note that the accelerometer
 	 sends -1 when static */
-      lo_send(pd_lo, "/vib", "i", pitch - 8193);
+      oscSendAt(midiWhen, "/vib", "i", pitch - 8193);
     }
-    *ptr += 3;
 
-  } else if (0xC0 == (**ptr & 0xf0)) {
+  } else if (0xC0 == (ev->status & 0xf0)) {
     /* Program Change - 7 bits of data spread
        over 2 of the 3 bytes to be sent to PD
        Zero and then set the relevant bits */
-    //fprintf(stderr, "Program Change: 0x%2.2X\n", *(*ptr + 1) & 0x7f);
-    midiKeys[0] &= 0x03;
-    midiKeys[0] |= (*(*ptr + 1) & 0x1f) << 3;
-    midiKeys[1] &= 0xfc;
-    midiKeys[1] |= (*(*ptr + 1) & 0x60) >> 5;
-    lo_send(pd_lo, "/sw", "iii", midiKeys[0], midiKeys[1], midiKeys[2]);
-    *ptr += 2;
-
-  } else if (0xB0 == (**ptr & 0xf0)) {
-    /* Control Change (2 bytes - controller, value)
-       Controller is *(*ptr + 1), data values in *(*ptr + 2) */
-    switch (*(*ptr + 1)) {
-    case 0x0B: /* Expression Controller MSB*/
-      //fprintf(stderr, "Expression: 0x%2.2X", *(*ptr + 2) & 0x7f);
-      analogueVal[6] = (int) (((*(*ptr + 2) & 0x07f) * 992) / 383);
-      //fprintf(stderr, "Expression: %d\n", analogueVal[6]);
-      lo_send(pd_lo, "/anlg", "iiiiiiii",
-	      analogueVal[0], analogueVal[1], analogueVal[2],
-	      analogueVal[3], analogueVal[4], analogueVal[5],
-	      analogueVal[6], analogueVal[7]);
-      break;
-
-    case 0x10: /* GP Controller 1 (octaviant level) */
-    case 0x11: /* GP Controller 2 (petit gambe level) */
-    case 0x12: /* GP Controller 3 (souffle level) */
-    case 0x13: /* GP Controller 4 (effect diffuseur level) */
-      /* For these 4 controllers, work out the analogue value
-	 to be changed from the controller number */
-      analogueVal[*(*ptr + 1) - 14] = (*(*ptr + 2) & 0x07f) << 3;
-      lo_send(pd_lo, "/anlg", "iiiiiiii",
-	      analogueVal[0], analogueVal[1], analogueVal[2],
-	      analogueVal[3], analogueVal[4], analogueVal[5],
-	      analogueVal[6], analogueVal[7]);     
-      break;
-
+    //fprintf(stderr, "Program Change: 0x%2.2X\n", ev->data1 & 0x7f);
+    midiSws[0] &= 0x03;
+    midiSws[0] |= (ev->data1 & 0x1f) << 3;
+    midiSws[1] &= 0xfc;
+    midiSws[1] |= (ev->data1 & 0x60) >> 5;
+    sendMidiSw();
+
+  } else if (0xB0 == (ev->status & 0xf0)) {
+    /* Control Change (2 bytes - controller, value). MSB / LSB pairs
+       and NRPNs are put together first, so ctrl is the controller (or
+       NRPN) and val its 14-bit value, data the top 7 bits */
+    uint16_t ctrl, val;
+    int8_t chan;
+    if (!midiCtrl14(&fileCtrl, ev, &ctrl, &val)) return;
+    uint8_t data = val >> 7;
+    switch (ctrl) {
     case 0x50: /* GPC 5 - Diffuseur selection */
-      midiKeys[1] &= 0x0f; // zero the existing Diffuseur selection
-      midiKeys[1] |= (*(*ptr + 2) & 0x7f) << 4;
-      lo_send(pd_lo, "/sw", "iii", midiKeys[0], midiKeys[1], midiKeys[2]);
+      midiSws[1] &= 0x0f; // zero the existing Diffuseur selection
+      midiSws[1] |= data << 4;
+      sendMidiSw();
       break;
 
     case 0x51: /* GPC 6 - clavier / ruban mode */
       /* Determines how pitchbend information is processed
 	 In Clavier mode pitch bind is interpreted and sent as /vib data
 	 but in Ruban mode as analogueVal[1] */
-      ruban = ((*(*ptr + 2) & 0x7f) < 64) ? 0 : 1;
-      midiKeys[1] &= 0xfb; // zero the existing C/R selection
-      if (ruban) midiKeys[1] |= 4;
-      lo_send(pd_lo, "/sw", "iii", midiKeys[0], midiKeys[1], midiKeys[2]);
+      ruban = (data < 64) ? 0 : 1;
+      midiSws[1] &= 0xfb; // zero the existing C/R selection
+      if (ruban) midiSws[1] |= 4;
+      sendMidiSw();
       break;
 
     case 0x52: /* GPC 7 - legato / claquement mode */
-      claquement = ((*(*ptr + 2) & 0x7f) < 64) ? 0 : 1;
-      midiKeys[1] &= 0xf7; // zero the existing L/C selection
-      if (claquement) midiKeys[1] |= 8;
-      lo_send(pd_lo, "/sw", "iii", midiKeys[0], midiKeys[1], midiKeys[2]);
+      claquement = (data < 64) ? 0 : 1;
+      midiSws[1] &= 0xf7; // zero the existing L/C selection
+      if (claquement) midiSws[1] |= 8;
+      sendMidiSw();
       break;
 
-    case 0x53: /* GPC 8 - Feutre pedal analogue value */
-      analogueVal[7] = (int) (*(*ptr + 2) & 0x07f) << 3;
-      lo_send(pd_lo, "/anlg", "iiiiiiii",
-	      analogueVal[0], analogueVal[1], analogueVal[2],
-	      analogueVal[3], analogueVal[4], analogueVal[5],
-	      analogueVal[6], analogueVal[7]);     
+    case MIDI_NRPN_ANLG(1): /* Ruban position, 14 bits */
+      if (ruban && !(liveMask & LIVE_ANLG(1))) {
+	/* As the pitch bend PD would play for that position */
+	playRuban((int) ((val / 16.0 * 0.0994 - 4.6 + 24 + octaveShift) *
+			 170.6666667 + 0.5));
+      }
+      break;
+
+    default:
+      /* Touche, level controls, Expression and Feutre */
+      if ((chan = ctrlChannel(ctrl)) >= 0) {
+	sendMidiAnlg(chan, ctrlAnlg(chan, val));
+      }
       break;
     }
     //fprintf(stderr, "\n");
-    *ptr += 3;
 
-  } else if (0x90 == (**ptr & 0xf0)) {
+  } else if ((0x90 == (ev->status & 0xf0)) && ev->data2) {
     /* Note On (2 bytes - note, velocity) */
-    //fprintf(stderr, "Note On: %d\n", *(*ptr + 1) & 0x7f);
-    lo_send(pd_lo, "/key", "ii", (*(*ptr + 1) & 0x7f) - octaveOffset, 1);
-    *ptr += 3;
-
-  } else if (0x80 == (**ptr & 0xf0)) {
-    /* Note Off (2 bytes - note, velocity) */
-    //fprintf(stderr, "Note Off: %d\n", *(*ptr + 1) & 0x7f);
-    if (claquement)
-      lo_send(pd_lo, "/key", "ii", (*(*ptr + 1) & 0x7f) - octaveOffset, 0);
-    *ptr += 3;
+    //fprintf(stderr, "Note On: %d\n", ev->data1 & 0x7f);
+    if (liveMask & LIVE_KEYS) return;
+    midiNote = ev->data1 - octaveOffset;
+    oscSendAt(midiWhen, "/key", "ii", midiNote, 1);
+
+  } else if ((0x80 == (ev->status & 0xf0)) || (0x90 == (ev->status & 0xf0))) {
+    /* Note Off (2 bytes - note, velocity), or Note On with velocity 0,
+       which most files use for note off along with running status */
+    //fprintf(stderr, "Note Off: %d\n", ev->data1 & 0x7f);
+    if (claquement && !(liveMask & LIVE_KEYS))
+      oscSendAt(midiWhen, "/key", "ii", ev->data1 - octaveOffset, 0);
   }
 }
 
-void selectMidiFile(void) {
-  /* Free any previously allocated memory */
-  if (NULL != midiFile) {
-    for (uint8_t i = 0; i <= midiCount; i++) {
-      free(midiFile[i]);
-    }
-    free(midiFile);
-  }
+void playRuban(int pitch) {
+  /* Ruban mode so send data as /midiRbn
+     Absolute pitch with 8192 equivalent to middle C (midi 60)
+     Allow for PD adding the octave offset to this value) */
+  oscSendAt(midiWhen, "/midiRbn", "f", (float) pitch / 170.6666667 - 24.0 - (float) octaveShift);
+}
 
-  /* Read the MIDI directory to find the available files */
-  DIR *dir = opendir("/home/pi/Ondes/MIDI");
-  struct dirent *ent;
-  midiCount = 0;
-  /* find out how many .mid files there are */
-  while (ent = readdir(dir)) {
-    if ((ent->d_type == DT_REG) && strncmp(ent->d_name, ".mid", 4)) {
-      ++midiCount;
-    }
+int8_t ctrlChannel(uint16_t ctrl) {
+  /* The analogue value a controller plays, or -1 */
+  switch (ctrl) {
+  case 0x07: /* Channel Volume (Touche, as recorded by the Ondes) */
+    return 0;
+  case 0x0B: /* Expression Controller */
+    return 6;
+  case 0x10: /* GP Controller 1 (octaviant level) */
+  case 0x11: /* GP Controller 2 (petit gambe level) */
+  case 0x12: /* GP Controller 3 (souffle level) */
+  case 0x13: /* GP Controller 4 (effect diffuseur level) */
+    return ctrl - 14;
+  case 0x53: /* GPC 8 - Feutre pedal analogue value */
+    return 7;
   }
-  rewinddir(dir);
-  /* Read the MIDI file names */
-  midiFile = malloc(sizeof(char *) * (midiCount + 1));
-  midiFile[0] = malloc(7 * sizeof(char));
-  strcpy(midiFile[0], "Cancel");
-  for (uint8_t i = 1; ent = readdir(dir);) {
-    uint8_t index = i;
-    if ((ent->d_type == DT_REG) && strncmp(ent->d_name, ".mid", 4)) {
-      /* Make space for the new entry at the end of the list */
-      midiFile[i] = malloc((strlen(ent->d_name) + 1) * sizeof(char));
-      strcpy(midiFile[i], ent->d_name);
-      char *tmpFile = midiFile[i];
-      /* If necessary rearrange the pointers to existing entries
-	 to fit the new one in alphabetically */
-      for (uint8_t j = i - 1;
-	   (strcasecmp(midiFile[j], ent->d_name) > 0) && (j > 0); j--) {
-	midiFile[j + 1] = midiFile[j];
-	index = j;
-      }
-      midiFile[index] = tmpFile;
-      ++i;
-    }
+  if ((ctrl & ~7) == MIDI_NRPN_ANLG(0)) return ctrl & 7;
+  return -1;
+}
+
+int16_t ctrlAnlg(uint8_t chan, uint16_t val) {
+  /* The analogue value for a 14-bit controller value. Expression has a
+     range of its own. 7-bit controllers come out as they always have */
+  if (6 == chan) return (int16_t) (((uint32_t) val * 992) / (383 << 7));
+  return val >> 4;
+}
+
+void sendMidiAnlg(uint8_t chan, int16_t val) {
+  /* Set an analogue value from the file unless the channel is being
+     played live. It counts as sent, so the main loop won't send it
+     again before its timetag */
+  if (liveMask & LIVE_ANLG(chan)) return;
+  pthread_mutex_lock(&anlgLock);
+  analogueVal[chan] = analogueLast[chan] = val;
+  oscSendAt(midiWhen, "/anlg", "iiiiiiii",
+	    analogueVal[0], analogueVal[1], analogueVal[2],
+	    analogueVal[3], analogueVal[4], analogueVal[5],
+	    analogueVal[6], analogueVal[7]);
+  pthread_mutex_unlock(&anlgLock);
+}
+
+void sendMidiSw(void) {
+  /* The switch settings from the file, unless they are being played
+     live. They are still tracked, since they decide how pitch bend and
+     notes from the file are played */
+  if (liveMask & LIVE_SWITCHES) return;
+  oscSendAt(midiWhen, "/sw", "iii", midiSws[0], midiSws[1], midiSws[2]);
+}
+
+void silenceMidiNote(void) {
+  /* Stop the note from the file when pausing, stopping or jumping,
+     but not a note being played live */
+  if (!(liveMask & LIVE_KEYS)) oscSend("/key", "ii", midiNote, 0);
+}
+
+uint16_t liveSources(void) {
+  return (MIDI_IDLE == midiState) ? LIVE_ALL : liveMask;
+}
+
+void lcdTitle(void) {
+  /* Top line of the LCD - shows recording, or the bars being looped */
+  lcd1602SetCursor(0, 0);
+  if (recording) {
+    lcd1602WriteString("Recording  >>>  ");
+  } else if (midiLoopB) {
+    char bars[24];
+    sprintf(bars, "%u-%u", midiLoopA, midiLoopB);
+    snprintf(lcdText, sizeof(lcdText), "Loop bars %-6s", bars);
+    lcd1602WriteString(lcdText);
+  } else if (midiLoopA) {
+    snprintf(lcdText, sizeof(lcdText), "Loop from %-6u", midiLoopA);
+    lcd1602WriteString(lcdText);
+  } else {
+    lcd1602WriteString("Ondes  Framboise");
   }
-  closedir(dir);
-  /* Now we have the available MIDI files so select the required one */
-  if (midiSel > midiCount) midiSel = 0;
-  lcd1602SetCursor(0, 1);
-  lcd1602WriteString("                ");
-  lcd1602SetCursor(0, 1);
-  lcd1602WriteString(midiFile[midiSel]);
-  uint8_t clicked = 0;
+}
+
+void selectMidiFile(void) {
+  /* Choose a file from the MIDI library, which is kept up to date in
+     the background so there's nothing to read here. 0 is Cancel */
+  if (midiSel > (int) midiLibCount) midiSel = 0;
+  showMidiFile();
   while (!encoderPress()) {
     if ((clicks = encoderRotate())) {
       midiSel += clicks / abs(clicks);
-      if (midiSel > midiCount) {
+      if (midiSel > (int) midiLibCount) {
 	midiSel = 0;
       } else if (midiSel < 0) {
-	midiSel = midiCount;
+	midiSel = midiLibCount;
       }
-      lcd1602SetCursor(0, 1);
-      lcd1602WriteString("                ");
-      lcd1602SetCursor(0, 1);
-      char tmpName[17];
-      strncpy(tmpName, midiFile[midiSel], 16);
-      lcd1602WriteString(tmpName);
+      showMidiFile();
     }
   }
+  lcdTitle();
   lcd1602SetCursor(0, 1);
   if (midiSel) {
+    /* Keep the path, as the library may change before it's played */
+    snprintf(midiPath, sizeof(midiPath), "%s", midiLib[midiSel - 1].path);
     playMidi = 1;
     lcd1602WriteString("Play MIDI Play  ");
   } else {
@@ -1610,6 +2463,90 @@ void selectMidiFile(void) {
   }
 }
 
+void showMidiFile(void) {
+  /* The file name on the bottom line of the LCD, and its title (or
+     tempo and tracks) and length on the top line */
+  lcd1602SetCursor(0, 0);
+  if (midiSel) {
+    const midiLibEntry *e = &midiLib[midiSel - 1];
+    char info[17];
+    uint32_t secs = e->micros / 1000000;
+    if (e->title[0]) {
+      snprintf(info, sizeof(info), "%s", e->title);
+    } else if (e->qtrMicros) {
+      snprintf(info, sizeof(info), "%ubpm %ut",
+	       (60000000 + e->qtrMicros / 2) / e->qtrMicros, e->tracks);
+    } else {
+      info[0] = 0;
+    }
+    snprintf(lcdText, sizeof(lcdText), "%-10.10s%3u:%02u", info,
+	     secs / 60, secs % 60);
+  } else {
+    snprintf(lcdText, sizeof(lcdText), "%u MIDI files%16s", midiLibCount, "");
+  }
+  lcd1602WriteString(lcdText);
+  lcd1602SetCursor(0, 1);
+  snprintf(lcdText, sizeof(lcdText), "%-16s",
+	   (midiSel) ? midiLib[midiSel - 1].name : "Cancel");
+  lcd1602WriteString(lcdText);
+}
+
+void startMidiRecord(const char *stamp) {
+  /* Record the performance to a MIDI file as well as the WAV, starting
+     with the current state. Called when a recording starts with no MIDI
+     file playing */
+  uint32_t now = myMicros();
+  uint8_t sw0 = prevSws[0], sw1 = prevSws[1];
+  if (midiRecStart(now)) {
+    fprintf(stderr, "Not enough memory to record MIDI\n");
+    return;
+  }
+  snprintf(recName, sizeof(recName), "%s", stamp);
+  if (sw0 & 4) {
+    /* 'T' turns on the voices, as in the main loop */
+    sw0 |= 248;
+    sw1 |= 1;
+  }
+  midiRecSw(now, sw0 & 254, sw1);
+  midiRecAnlg(now, analogueVal, octaveShift);
+  midiRecVib(now, vib);
+  if (lastPlay) midiRecKey(now, lastKey - 36, lastPlay, octaveShift);
+}
+
+void stopMidiRecord(void) {
+  /* Save the recorded performance as ondes<date><time>.mid, with the
+     same name as the WAV, in /home/pi/Ondes/MIDI (the MIDI library) */
+  char path[300], title[33];
+  if (!midiRecOn) return;
+  snprintf(path, sizeof(path), "%s/ondes%s.mid", midiDirs[0], recName);
+  snprintf(title, sizeof(title), "Ondes Framboise %s", recName);
+  if (midiRecStop(path, title)) fprintf(stderr, "Failed to save %s\n", path);
+}
+
+void sendMpe(uint32_t micros, uint16_t live) {
+  /* Play the MPE output from the instrument: in Ruban mode one note
+     gliding from the pitch it started at, otherwise the key played, each
+     bent by the vibrato as PD bends it. The Touche (or a MIDI keyboard's
+     dynamics) is the pressure and the Feutre the timbre. MIDI playback
+     isn't sent */
+  if (!mpeOn) return;
+  if (!(live & LIVE_KEYS)) {
+    mpeFrame(micros, -1, 0, 0, 0, 0);
+    return;
+  }
+  uint8_t pressure = analogueVal[0] * 127 / TOUCHE_MAX;
+  float pitch = vib / 25.0 + 0.04;
+  if (prevSws[1] & 4) {
+    pitch += 36 + octaveShift + analogueVal[1] * 0.0994 - 4.6;
+    mpeFrame(micros, -1, pitch, pressure > 0, pressure,
+	     analogueVal[7] >> 3);
+  } else {
+    int note = lastKey + octaveShift;
+    mpeFrame(micros, note, pitch + note, lastPlay, pressure,
+	     analogueVal[7] >> 3);
+  }
+}
+
 void gpioSetMode(uint8_t gpio, uint8_t mode) {
   int reg, shift;
 
@@ -1760,3 +2697,414 @@ int8_t gpioInitialise(void) {
   }
   return 0;
 }
+
+/* Keyboard and switch backends. Each has
+   kbdOpen()  to set up the hardware
+   kbdScan()  to read the switches into switches[3] (as sent in /sw),
+              returning 1 if anything has changed
+   kbdKeys()  to play the keys after a scan which found a change
+   kbdWait()  to sleep for up to 1ms between passes of the main loop
+   kbdClose() at shutdown */
+#ifdef MIDI_KEYBOARD
+
+void kbdOpen(void) {
+  /* Set up the mcp23s08 on SPI0.1 and configure its ports, and the
+     GPIO19, 20 & 21 lines which select the banks of switches */
+  mcp23s08_fd = spi_open(1);
+  const uint8_t ioconfig = SEQOP_OFF | DISSLW_OFF | HAEN_OFF | ODR_OFF | INTPOL_LOW;
+  mcp23s08_write_reg(ioconfig, IOCON, 0, mcp23s08_fd);
+  mcp23s08_write_reg(0xFF, IODIR, 0, mcp23s08_fd); // all pins are inputs
+  mcp23s08_write_reg(0xFF, GPPU,  0, mcp23s08_fd); // enable pullups
+  gpioSetMode(SW_1, PI_OUTPUT);
+  gpioWrite(SW_1, 1);
+  gpioSetMode(SW_2, PI_OUTPUT);
+  gpioWrite(SW_2, 1);
+  gpioSetMode(SW_3, PI_OUTPUT);
+  gpioWrite(SW_3, 1);
+
+  /* Start listening to the MIDI keyboards. Any not plugged in yet are
+     picked up when they are */
+  dynFillTable();
+  const char *kbList[MIDIIN_MAX];
+  for (uint8_t i = 0; i < kbCount; i++) kbList[i] = kbNames[i];
+  midiInOpen(kbList, kbCount);
+}
+
+uint8_t kbdScan(uint8_t *switches) {
+  /* Scan the physical switches into the switches[] array:
+     01 - 07 addressed by GPIO19 (there is no switch in the first position)
+     08 - 15 addressed by GPIO20
+     16 - 23 addressed by GPIO21  */
+  uint8_t changed = 0;
+  uint8_t gpio[] = {SW_1, SW_2, SW_3};
+  for (uint8_t i = 0; i <= 2; i++) {
+    /* pull the rows of the switch matrix low in turn */
+    gpioWrite(gpio[i], 0);
+    switches[i] = mcp23s08_read_reg(GPIO, 0, mcp23s08_fd);
+    /* Invert here so ON switches = 1, OFF = 0 before sending to PD */
+    switches[i] = ~switches[i];
+
+    if (switches[i] != prevSws[i]) {
+      changed = 1;
+      prevSws[i] = switches[i];
+    }
+    gpioWrite(gpio[i], 1);
+  }
+  if (changed && debug) fprintf(stderr,
+      "Switches: %2.2x %2.2x %2.2x\n",
+      switches[2], switches[1], switches[0]);
+  return changed;
+}
+
+void kbdKeys(uint16_t live, const uint8_t *switches) {
+  /* Nothing to do - the keys are played as they arrive, by
+     keyboardEvent() */
+  (void) live;
+  (void) switches;
+}
+
+void kbdWait(void) {
+  /* Sleep for up to 1ms, but wake as soon as a keyboard sends
+     anything and play it straight away */
+  struct pollfd kbPoll[MIDIIN_MAX + 1];
+  int kbFds = midiInFds(kbPoll, MIDIIN_MAX + 1);
+  if (kbFds > 0) {
+    poll(kbPoll, kbFds, 1);
+  } else {
+    usleep(1000);
+  }
+  midiInService(myMicros(), keyboardEvent);
+}
+
+void kbdClose(void) {
+  if (debug) fprintf(stderr, "MIDI keyboards: %u messages, %u overruns\n",
+		     midiInEvents, midiInLost);
+  midiInClose();
+}
+
+void dynFillTable(void) {
+  /* Work out the response curve once, so a note or aftertouch only
+     costs a table lookup */
+  for (uint8_t i = 0; i < 128; i++) {
+    dynTable[i] = (int16_t) (TOUCHE_MAX * pow(i / 127.0, dynCurve) + 0.5);
+  }
+}
+
+int16_t dynTouche(void) {
+  /* The Touche value to play. Aftertouch can only swell a note beyond
+     the level it was struck at, so letting go of the pressure doesn't
+     cut it off */
+  int16_t level = (dynVelocity > dynPressure) ? dynVelocity : dynPressure;
+  switch (dynMode) {
+  case DYN_BLEND:
+    return (level > toucheVal) ? level : toucheVal;
+  case DYN_OVERRIDE:
+    return level;
+  default:
+    return toucheVal;
+  }
+}
+
+void keyRelease(uint8_t key) {
+  /* Release a key unless it is still held on another keyboard */
+  for (uint8_t i = 0; i < MIDIIN_MAX; i++) {
+    if ((inputKeys[i][key >> 6] >> (key & 63)) & 1) return;
+  }
+  keysRelease(&heldKeys, key);
+}
+
+uint8_t keyboardCtrl(const midiEvent *ev) {
+  /* A controller from a MIDI keyboard, ribbon controller etc. for one of
+     the analogue values being played live. From then on that value comes
+     from MIDI rather than the hardware. Returns 1 if a value changed */
+  uint16_t ctrl, val;
+  int8_t chan;
+  int16_t old;
+  if (!midiCtrl14(&kbCtrl[ev->track % MIDIIN_MAX], ev, &ctrl, &val) ||
+      ((chan = ctrlChannel(ctrl)) < 0) ||
+      !(liveSources() & LIVE_ANLG(chan))) return 0;
+  pthread_mutex_lock(&anlgLock);
+  kbAnlg |= 1 << chan;
+  old = analogueVal[chan];
+  if (0 == chan) {
+    toucheVal = (int16_t) ((uint32_t) val * TOUCHE_MAX / 16383);
+    analogueVal[0] = dynTouche();
+  } else {
+    analogueVal[chan] = ctrlAnlg(chan, val);
+  }
+  pthread_mutex_unlock(&anlgLock);
+  return old != analogueVal[chan];
+}
+
+void keyboardEvent(const midiEvent *ev) {
+  /* A message from a MIDI keyboard, on any channel. Note On with
+     velocity 0 is a Note Off, and All Notes Off (also sent when a
+     keyboard is unplugged) releases every key held on that keyboard. A
+     key is held while it is held on any keyboard. After every note send
+     the key chosen by the note priority (lowest, as on the Ondes, unless
+     set otherwise in the menu).
+     In legato mode send nothing if no keys are pressed, in claquement
+     mode send 'play 0' when the last key is released. The velocity of
+     the note played, and channel or poly aftertouch on it, set the
+     Touche if the dynamics are on. The Touche goes first so the note
+     starts at its level. Controllers for the analogue values (including
+     14-bit pairs and NRPNs) play them instead of the hardware. The key
+     is played the same fixed latency after it was pressed as the
+     analogue values after they were read, so it keeps its timing
+     against the Touche */
+  uint8_t type = ev->status & 0xf0;
+  uint64_t *held = inputKeys[ev->track % MIDIIN_MAX];
+  lo_timetag *keyWhen = NULL;
+  uint8_t anlgChanged = 0;
+  if ((0x90 == type) && ev->data2) {
+    held[ev->data1 >> 6] |= (uint64_t) 1 << (ev->data1 & 63);
+    keysPress(&heldKeys, ev->data1);
+  } else if ((0x80 == type) || (0x90 == type)) {
+    held[ev->data1 >> 6] &= ~((uint64_t) 1 << (ev->data1 & 63));
+    keyRelease(ev->data1);
+  } else if ((0xd0 == type) ||
+	     ((0xa0 == type) && (ev->data1 == keysNote(&heldKeys)))) {
+    int16_t pressure = dynTable[(0xd0 == type) ? ev->data1 : ev->data2];
+    if (pressure == dynPressure) return;
+    dynPressure = pressure;
+  } else if ((0xb0 == type) && (123 == ev->data1)) {
+    for (uint8_t i = 0; i < 2; i++) {
+      while (held[i]) {
+	uint8_t key = i * 64 + __builtin_ctzll(held[i]);
+	held[i] &= held[i] - 1;
+	keyRelease(key);
+      }
+    }
+  } else if (0xb0 == type) {
+    if (!(anlgChanged = keyboardCtrl(ev))) return;
+  } else {
+    return;
+  }
+  uint8_t note = keysNote(&heldKeys);
+  if ((0x90 == type) && ev->data2 && (note == ev->data1)) {
+    /* A new note - struck at its velocity */
+    dynVelocity = dynTable[ev->data2];
+    dynPressure = 0;
+  } else if (KEYS_NONE == note) {
+    /* No key held, so the dynamics let go of the Touche - in override
+       mode the note falls silent even in legato mode */
+    dynVelocity = 0;
+    dynPressure = 0;
+  }
+  uint16_t live = liveSources();
+  if (anlgLatency) {
+    int late = (int) (myMicros() - ev->micros);
+    lo_timetag_now(&keyTT);
+    if (late < (int) anlgLatency) oscTimetagAdd(&keyTT, anlgLatency - late);
+    keyWhen = &keyTT;
+  }
+  pthread_mutex_lock(&anlgLock);
+  if (dynMode && (live & LIVE_ANLG(0)) && (dynTouche() != analogueVal[0])) {
+    analogueVal[0] = dynTouche();
+    anlgChanged = 1;
+  }
+  if (anlgChanged) {
+    /* They count as sent, so the scan won't send them again */
+    memcpy(analogueLast, analogueVal, sizeof(analogueLast));
+    oscSendAt(keyWhen, "/anlg", "iiiiiiii",
+	      analogueVal[0], analogueVal[1], analogueVal[2],
+	      analogueVal[3], analogueVal[4], analogueVal[5],
+	      analogueVal[6], analogueVal[7]);
+    midiRecAnlg(ev->micros, analogueVal, octaveShift);
+  }
+  pthread_mutex_unlock(&anlgLock);
+  if (!(live & LIVE_KEYS) || (0xa0 == type) || (0xd0 == type) ||
+      ((0xb0 == type) && (123 != ev->data1))) {
+    /* Aftertouch and controllers only play the analogue values, and if
+       the notes are being played from a MIDI file just keep track of
+       the keys */
+    return;
+  }
+  if ((KEYS_NONE == note) && (prevSws[1] & 8)) {
+    /* All keys released - send play=0 if claquement mode */
+    lastPlay = 0;
+    oscSendAt(keyWhen, "/key", "ii", lastKey - 36, lastPlay);
+  } else if (KEYS_NONE != note) {
+    /* Send the 'real' note to PD */
+    lastKey = note;
+    lastPlay = 1;
+    oscSendAt(keyWhen, "/key", "ii", lastKey - 36, lastPlay);
+  }
+  midiRecKey(ev->micros, lastKey - 36, lastPlay, octaveShift);
+  sendMpe(ev->micros, live);
+}
+
+uint8_t mcp23s08_read_reg(uint8_t reg, uint8_t hw_addr, int fd) {
+  uint8_t control_byte = get_spi_control_byte(READ_CMD, hw_addr);
+  uint8_t tx_buf[3] = {control_byte, reg, 0};
+  uint8_t rx_buf[sizeof tx_buf];
+
+  struct spi_ioc_transfer spi;
+  memset (&spi, 0, sizeof(spi));
+  spi.tx_buf = (unsigned long) tx_buf;
+  spi.rx_buf = (unsigned long) rx_buf;
+  spi.len = sizeof tx_buf;
+  spi.delay_usecs = spi_delay;
+  spi.speed_hz = spi_speed;
+  spi.bits_per_word = spi_bpw;
+
+  // do the SPI transaction
+  if ((ioctl(fd, SPI_IOC_MESSAGE(1), &spi) < 0)) {
+    fprintf(stderr,
+            "mcp23s08_read_reg: There was an error during the SPI transaction.\n");
+    return -1;
+  }
+
+  // return the data
+  return rx_buf[2];
+}
+
+void mcp23s08_write_reg(uint8_t data, uint8_t reg, uint8_t hw_addr, int fd) {
+  uint8_t control_byte = get_spi_control_byte(WRITE_CMD, hw_addr);
+  uint8_t tx_buf[3] = {control_byte, reg, data};
+  uint8_t rx_buf[sizeof tx_buf];
+
+  struct spi_ioc_transfer spi;
+  memset (&spi, 0, sizeof(spi));
+  spi.tx_buf = (unsigned long) tx_buf;
+  spi.rx_buf = (unsigned long) rx_buf;
+  spi.len = sizeof tx_buf;
+  spi.delay_usecs = spi_delay;
+  spi.speed_hz = spi_speed;
+  spi.bits_per_word = spi_bpw;
+
+  // do the SPI transaction
+  if ((ioctl(fd, SPI_IOC_MESSAGE(1), &spi) < 0)) {
+    fprintf(stderr,
+            "mcp23s08_write_reg: There was an error during the SPI transaction.\n");
+  }
+}
+
+static uint8_t get_spi_control_byte(uint8_t rw_cmd, uint8_t hw_addr) {
+  hw_addr = (hw_addr << 1) & 0xE;
+  rw_cmd &= 1; // just 1 bit long
+  return 0x40 | hw_addr | rw_cmd;
+}
+
+#else
+
+void kbdOpen(void) {
+  /* Set up the mcp23s17 on SPI0.1 and configure its ports, and GPIO24
+     which selects the final bank of switches */
+  mcp23s17_fd = mcp23s17_open(0, 1);
+  const uint8_t ioconfig = BANK_OFF |       \
+                           INT_MIRROR_OFF | \
+                           SEQOP_OFF |      \
+                           DISSLW_OFF |     \
+                           HAEN_ON |        \
+                           ODR_OFF |        \
+                           INTPOL_LOW;
+  mcp23s17_write_reg(ioconfig, IOCON, 0, mcp23s17_fd);
+  mcp23s17_write_reg(0x00, IODIRA, 0, mcp23s17_fd); // PORT A ALL OUTPUT
+  mcp23s17_write_reg(0xff, GPIOA,  0, mcp23s17_fd); // PORT A ALL HIGH
+  mcp23s17_write_reg(0xff, IODIRB, 0, mcp23s17_fd); // PORT B ALL INPUT
+  mcp23s17_write_reg(0xff, GPPUB,  0, mcp23s17_fd); // PORT B PULLUPS
+  gpioSetMode(SW_SEL, PI_OUTPUT);
+  gpioWrite(SW_SEL, 1);
+}
+
+uint8_t kbdScan(uint8_t *switches) {
+  /* Scan the keyboard and switch array
+     Keys are in the range 0 - 48, switches are 49 - 63 on the
+     MCP32S17 plus 64 - 71 addressed via GPIO24. The key rows are kept
+     in prevRows[], the rest is switches[] */
+  uint8_t mask = 1;
+  uint8_t keys[8];
+  uint8_t changed = 0;
+  for (uint8_t i = 0; i < 8; i++) {
+    /* set the 'i'th bit of Port A to 0 for the keyboard / switch
+       scan (starting at the right-hand end) */
+    mcp23s17_write_reg((uint8_t) ~mask, GPIOA, 0, mcp23s17_fd);
+    mask <<= 1;
+    keys[i] = (uint8_t) mcp23s17_read_reg(GPIOB, 0, mcp23s17_fd);
+    /* Invert so pressed keys are 1, others 0. Do it this way so
+     * that we only have one bit to shift in the keymask (below) */
+    keys[i] = ~keys[i];
+  }
+  /* Set all pins high on MCP23S17 port A, set SW_SEL (GPIO24) low
+     and read the final bank of switches */
+  mcp23s17_write_reg(255, GPIOA, 0, mcp23s17_fd);
+  gpioWrite(SW_SEL, 0);
+  switches[2] = (uint8_t) mcp23s17_read_reg(GPIOB, 0, mcp23s17_fd);
+  gpioWrite(SW_SEL, 1);
+  switches[2] = ~switches[2];
+  switches[0] = keys[6];
+  switches[1] = keys[7];
+
+  for (uint8_t i = 0; i < 6; i++) {
+    if (keys[i] != prevRows[i]) {
+      changed = 1;
+      prevRows[i] = keys[i];
+    }
+  }
+  for (uint8_t i = 0; i < 3; i++) {
+    if (switches[i] != prevSws[i]) {
+      changed = 1;
+      prevSws[i] = switches[i];
+    }
+  }
+  if (changed && debug) fprintf(stderr,
+      "Keys: %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x\n",
+      switches[2], switches[1], switches[0], keys[5], keys[4], keys[3],
+      keys[2], keys[1], keys[0]);
+  return changed;
+}
+
+void kbdKeys(uint16_t live, const uint8_t *switches) {
+  /* Press and release the keys which have changed, then play the
+     one chosen by the note priority (lowest, as on the Ondes, unless
+     set otherwise in the menu). Keys 0 - 48 are held as MIDI notes
+     36 - 84, and keys pressed in the same scan are taken as pressed
+     from the bottom up.
+     In legato mode send nothing if no keys are pressed,
+     in claquement mode send 'play 0' message when the
+     last key is released. Leave the notes alone if they are being
+     played from a MIDI file */
+  uint64_t held = (uint64_t) (switches[0] & 1) << 48;
+  for (uint8_t i = 0; i < 6; i++) held |= (uint64_t) prevRows[i] << (i * 8);
+  uint64_t notes[2] = { held << 36, held >> 28 };
+  for (uint8_t w = 0; w < 2; w++) {
+    for (uint64_t diff = notes[w] ^ heldKeys.bits[w]; diff; diff &= diff - 1) {
+      uint8_t key = __builtin_ctzll(diff);
+      if ((notes[w] >> key) & 1) {
+	keysPress(&heldKeys, w * 64 + key);
+      } else {
+	keysRelease(&heldKeys, w * 64 + key);
+      }
+    }
+  }
+  uint8_t note = keysNote(&heldKeys);
+  if (!(live & LIVE_KEYS)) {
+    /* Keep track of the keys only */
+  } else if (KEYS_NONE != note) {
+    lastKey = note;
+    lastPlay = 1;
+    oscSend("/key", "ii", lastKey - 36, lastPlay);
+  } else if (switches[1] & 8) {
+    /* 'Interrupted mode' on keyboard */
+    lastPlay = 0;
+    oscSend("/key", "ii", lastKey - 36, lastPlay);
+  } else {
+    /* 'Legato mode' */
+    lastPlay = 1;
+    oscSend("/key", "ii", lastKey - 36, lastPlay);
+  }
+  if (live & LIVE_KEYS) {
+    midiRecKey(myMicros(), lastKey - 36, lastPlay, octaveShift);
+  }
+  sendMpe(myMicros(), live);
+}
+
+void kbdWait(void) {
+  usleep(1000);
+}
+
+void kbdClose(void) {
+}
+
+#endif
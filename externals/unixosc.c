@@ -0,0 +1,169 @@
+/*
+  unixosc.c
+
+  Pure Data external which sends and receives OSC packets over Unix domain
+  datagram sockets, as a drop-in replacement for the [udpsend] / [udpreceive]
+  pair from mrpeach when ondes_server is run with the -unix option (or with
+  'transport unix' in /home/pi/.ondesconfig). Packets are passed in and out
+  as lists of byte values, exactly as [packOSC] produces and [unpackOSC]
+  expects, so nothing else in the patch needs to change.
+
+  Messages:
+    bind <path>     create and listen on a socket at <path> (any stale
+                    socket file left behind by a crash is removed first)
+    connect <path>  set the destination for outgoing packets
+    disconnect      forget the destination
+    close           stop listening and remove the socket file
+    list / send     bytes of an OSC packet to send to the destination
+
+  Outlets:
+    0 - received packets as lists of bytes
+    1 - 1 when connected, 0 when not (like [udpsend])
+
+  Build and install:
+    cc -O2 -shared -fPIC -o ~/Pd/externals/unixosc.pd_linux unixosc.c -I/usr/include/pd
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "m_pd.h"
+
+#define UNIXOSC_MAXPACKET 65536
+
+static t_class *unixosc_class;
+
+typedef struct _unixosc {
+  t_object x_obj;
+  t_outlet *x_msgout;
+  t_outlet *x_connectout;
+  int x_fd;
+  int x_connected;
+  struct sockaddr_un x_bound;
+  struct sockaddr_un x_peer;
+  unsigned char x_buf[UNIXOSC_MAXPACKET];
+  t_atom x_atoms[UNIXOSC_MAXPACKET];
+} t_unixosc;
+
+static int unixosc_socket(t_unixosc *x) {
+  /* Create the datagram socket on first use. The same socket is used for
+     sending and receiving so the peer could reply to us if it wants to */
+  if (x->x_fd < 0) {
+    x->x_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (x->x_fd < 0) pd_error(x, "unixosc: socket: %s", strerror(errno));
+  }
+  return x->x_fd;
+}
+
+static void unixosc_read(t_unixosc *x, int fd) {
+  /* Called from the PD scheduler when the socket is readable. Drain every
+     waiting packet so a burst of messages doesn't queue up behind DSP */
+  ssize_t len;
+  while ((len = recv(fd, x->x_buf, UNIXOSC_MAXPACKET, MSG_DONTWAIT)) > 0) {
+    for (ssize_t i = 0; i < len; i++) {
+      SETFLOAT(&x->x_atoms[i], (t_float) x->x_buf[i]);
+    }
+    outlet_list(x->x_msgout, &s_list, (int) len, x->x_atoms);
+  }
+}
+
+static void unixosc_close(t_unixosc *x) {
+  if (x->x_fd >= 0) {
+    sys_rmpollfn(x->x_fd);
+    close(x->x_fd);
+    x->x_fd = -1;
+  }
+  if (x->x_bound.sun_path[0]) {
+    unlink(x->x_bound.sun_path);
+    x->x_bound.sun_path[0] = 0;
+  }
+  if (x->x_connected) {
+    x->x_connected = 0;
+    outlet_float(x->x_connectout, 0);
+  }
+}
+
+static void unixosc_bind(t_unixosc *x, t_symbol *path) {
+  unixosc_close(x);
+  if (unixosc_socket(x) < 0) return;
+  memset(&x->x_bound, 0, sizeof(x->x_bound));
+  x->x_bound.sun_family = AF_UNIX;
+  strncpy(x->x_bound.sun_path, path->s_name, sizeof(x->x_bound.sun_path) - 1);
+  unlink(x->x_bound.sun_path);
+  if (bind(x->x_fd, (struct sockaddr *) &x->x_bound,
+	   sizeof(x->x_bound)) < 0) {
+    pd_error(x, "unixosc: bind %s: %s", path->s_name, strerror(errno));
+    x->x_bound.sun_path[0] = 0;
+    return;
+  }
+  sys_addpollfn(x->x_fd, (t_fdpollfn) unixosc_read, x);
+}
+
+static void unixosc_connect(t_unixosc *x, t_symbol *path) {
+  if (unixosc_socket(x) < 0) return;
+  memset(&x->x_peer, 0, sizeof(x->x_peer));
+  x->x_peer.sun_family = AF_UNIX;
+  strncpy(x->x_peer.sun_path, path->s_name, sizeof(x->x_peer.sun_path) - 1);
+  x->x_connected = 1;
+  outlet_float(x->x_connectout, 1);
+}
+
+static void unixosc_disconnect(t_unixosc *x) {
+  if (x->x_connected) {
+    x->x_connected = 0;
+    outlet_float(x->x_connectout, 0);
+  }
+}
+
+static void unixosc_send(t_unixosc *x, t_symbol *s, int argc, t_atom *argv) {
+  if (!x->x_connected || (argc <= 0)) return;
+  if (argc > UNIXOSC_MAXPACKET) argc = UNIXOSC_MAXPACKET;
+  for (int i = 0; i < argc; i++) {
+    x->x_buf[i] = (unsigned char) atom_getfloatarg(i, argc, argv);
+  }
+  /* The server may not be listening yet (or may have been restarted) so
+     a failed send is not treated as fatal, just reported */
+  if (sendto(x->x_fd, x->x_buf, argc, MSG_DONTWAIT,
+	     (struct sockaddr *) &x->x_peer, sizeof(x->x_peer)) < 0) {
+    if ((ENOENT != errno) && (ECONNREFUSED != errno)) {
+      pd_error(x, "unixosc: send to %s: %s", x->x_peer.sun_path,
+	       strerror(errno));
+    }
+  }
+}
+
+static void *unixosc_new(void) {
+  t_unixosc *x = (t_unixosc *) pd_new(unixosc_class);
+  x->x_msgout = outlet_new(&x->x_obj, &s_list);
+  x->x_connectout = outlet_new(&x->x_obj, &s_float);
+  x->x_fd = -1;
+  x->x_connected = 0;
+  memset(&x->x_bound, 0, sizeof(x->x_bound));
+  memset(&x->x_peer, 0, sizeof(x->x_peer));
+  return x;
+}
+
+static void unixosc_free(t_unixosc *x) {
+  unixosc_close(x);
+}
+
+void unixosc_setup(void) {
+  unixosc_class = class_new(gensym("unixosc"), (t_newmethod) unixosc_new,
+			    (t_method) unixosc_free, sizeof(t_unixosc),
+			    0, 0);
+  class_addmethod(unixosc_class, (t_method) unixosc_bind,
+		  gensym("bind"), A_SYMBOL, 0);
+  class_addmethod(unixosc_class, (t_method) unixosc_connect,
+		  gensym("connect"), A_SYMBOL, 0);
+  class_addmethod(unixosc_class, (t_method) unixosc_disconnect,
+		  gensym("disconnect"), 0);
+  class_addmethod(unixosc_class, (t_method) unixosc_close,
+		  gensym("close"), 0);
+  class_addmethod(unixosc_class, (t_method) unixosc_send,
+		  gensym("send"), A_GIMME, 0);
+  class_addlist(unixosc_class, (t_method) unixosc_send);
+}